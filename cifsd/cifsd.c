@@ -19,11 +19,17 @@
 #include <sys/file.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <signal.h>
 
 #include <ipc.h>
+#include <ipc_transport.h>
+#include <ipc_trace.h>
 #include <rpc.h>
 #include <worker.h>
+#include <nss_resolver.h>
 #include <config_parser.h>
 #include <management/user.h>
 #include <management/share.h>
@@ -36,6 +42,7 @@ static pid_t worker_pid;
 static int lock_fd = -1;
 static char *pwddb = PATH_PWDDB;
 static char *smbconf = PATH_SMBCONF;
+static char *ipc_trace_path;
 
 typedef int (*worker_fn)(void);
 
@@ -47,6 +54,8 @@ static void usage(void)
 	fprintf(stderr, "\t--u=pwd.db | --users=pwd.db       Users DB\n");
 	fprintf(stderr, "\t--n | --nodetach                  Don't detach\n");
 	fprintf(stderr, "\t--s | --systemd                   Service mode\n");
+	fprintf(stderr, "\t--i=PATH | --ipc-socket=PATH      Talk to a fake kernel on UNIX socket PATH\n");
+	fprintf(stderr, "\t--r=PATH | --record=PATH          Record inbound IPC events to PATH\n");
 	fprintf(stderr, "\t-V | --version                    Show version\n");
 	fprintf(stderr, "\t-h | --help                       Show help\n");
 
@@ -145,6 +154,9 @@ static int setup_signals(sighandler_t handler)
 	if (setup_signal_handler(SIGHUP, handler) != 0)
 		return -EINVAL;
 
+	if (setup_signal_handler(SIGUSR1, handler) != 0)
+		return -EINVAL;
+
 	if (setup_signal_handler(SIGSEGV, handler) != 0)
 		return -EINVAL;
 
@@ -169,47 +181,47 @@ static int parse_configs(char *pwddb, char *smbconf)
 		pr_err("Unable to parse smb configuration file\n");
 		return ret;
 	}
+
+	/* No requests yet, so we can afford to wait for NSS */
+	shm_resolve_pending_force_ids(1);
 	return 0;
 }
 
+static void worker_process_dump_stats(void)
+{
+	ipc_dump_stats();
+	wp_dump_stats();
+	nss_dump_stats();
+}
+
 static void worker_process_free(void)
 {
 	/*
 	 * NOTE, this is the final release, we don't look at ref_count
 	 * values. User management should be destroyed last.
+	 * Workers go first, so they don't queue responses to
+	 * the IPC sender after it's gone.
 	 */
+	wp_destroy();
 	ipc_destroy();
+	ipc_trace_close();
 	rpc_destroy();
-	wp_destroy();
 	sm_destroy();
 	shm_destroy();
 	usm_destroy();
+	nss_resolver_destroy();
 }
 
+/*
+ * Only synchronous fatal signals (SIGSEGV, SIGABRT) end up here, the
+ * rest is blocked from before fork() on and read from a signalfd by
+ * the worker main loop. The process is in an unknown state: tearing
+ * it down would join threads, maybe the one we are running on, so
+ * just leave and let the manager start a new worker.
+ */
 static void child_sig_handler(int signo)
 {
-	static volatile int fatal_delivered = 0;
-
-	if (signo == SIGHUP) {
-		/*
-		 * This is a signal handler, we can't take any locks, set
-		 * a flag and wait for normal execution context to re-read
-		 * the configs.
-		 */
-		cifsd_health_status |= CIFSD_SHOULD_RELOAD_CONFIG;
-		pr_debug("Scheduled a config reload action.\n");
-		return;
-	}
-
-	pr_err("Child received signal: %d (%s)\n",
-		signo, strsignal(signo));
-
-	if (!g_atomic_int_compare_and_exchange(&fatal_delivered, 0, 1))
-		return;
-
-	cifsd_health_status &= ~CIFSD_HEALTH_RUNNING;
-	worker_process_free();
-	exit(EXIT_SUCCESS);
+	_exit(EXIT_FAILURE);
 }
 
 static void manager_sig_handler(int signo)
@@ -228,6 +240,16 @@ static void manager_sig_handler(int signo)
 		return;
 	}
 
+	/*
+	 * Pass SIGUSR1 to worker, so it will dump its statistics
+	 */
+	if (signo == SIGUSR1) {
+		if (worker_pid && kill(worker_pid, signo))
+			pr_err("Unable to send SIGUSR1 to %d: %s\n",
+				worker_pid, strerr(errno));
+		return;
+	}
+
 	setup_signals(SIG_DFL);
 	wait_group_kill(signo);
 	pr_info("Exiting. Bye!\n");
@@ -249,18 +271,219 @@ static int parse_reload_configs(const char *pwddb, const char *smbconf)
 	}
 
 	ret = cp_parse_reload_smbconf(smbconf);
-	if (ret)
+	if (ret) {
 		pr_err("Unable to parse smb.conf\n");
+		return ret;
+	}
+	shm_resolve_pending_force_ids(0);
+
+	return wp_resize();
+}
+
+/*
+ * Housekeeping timer period, in seconds. Statistics are flushed to the
+ * log every CIFSD_STATS_FLUSH_TICKS periods.
+ */
+#define CIFSD_HOUSEKEEPING_INTERVAL	10
+#define CIFSD_STATS_FLUSH_TICKS		360
+
+static void worker_process_housekeeping(void)
+{
+	static unsigned int ticks;
+
+	ipc_housekeeping();
+	ipc_trace_flush();
+	nss_housekeeping();
+	shm_resolve_pending_force_ids(0);
+
+	if (++ticks % CIFSD_STATS_FLUSH_TICKS == 0)
+		worker_process_dump_stats();
+}
+
+/* (Re)arm the stall watchdog for the current threshold, or disarm it */
+static int worker_arm_watchdog(int wdfd)
+{
+	int interval = wp_watchdog_interval();
+	struct itimerspec its = {
+		.it_interval.tv_sec = interval / 1000,
+		.it_interval.tv_nsec = (interval % 1000) * 1000000,
+		.it_value.tv_sec = interval / 1000,
+		.it_value.tv_nsec = (interval % 1000) * 1000000,
+	};
+
+	if (timerfd_settime(wdfd, 0, &its, NULL)) {
+		pr_err("Unable to arm watchdog timer: %s\n", strerr(errno));
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/* Signals the worker takes from its signalfd */
+static void worker_signal_set(sigset_t *set)
+{
+	sigemptyset(set);
+	sigaddset(set, SIGINT);
+	sigaddset(set, SIGTERM);
+	sigaddset(set, SIGQUIT);
+	sigaddset(set, SIGHUP);
+	sigaddset(set, SIGUSR1);
+}
+
+static int worker_block_signals(sigset_t *set)
+{
+	worker_signal_set(set);
+
+	/* Must be done before we create any threads */
+	if (sigprocmask(SIG_BLOCK, set, NULL)) {
+		pr_err("Unable to block signals: %s\n", strerr(errno));
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static void worker_process_signal(int sfd)
+{
+	struct signalfd_siginfo si;
+
+	while (read(sfd, &si, sizeof(si)) == sizeof(si)) {
+		switch (si.ssi_signo) {
+		case SIGHUP:
+			cifsd_health_status |= CIFSD_SHOULD_RELOAD_CONFIG;
+			pr_debug("Scheduled a config reload action.\n");
+			break;
+		case SIGUSR1:
+			cifsd_health_status |= CIFSD_SHOULD_DUMP_STATS;
+			break;
+		default:
+			pr_info("Child received signal: %d (%s)\n",
+				si.ssi_signo, strsignal(si.ssi_signo));
+			cifsd_health_status &= ~CIFSD_HEALTH_RUNNING;
+			break;
+		}
+	}
+}
+
+static int worker_process_loop(sigset_t *set)
+{
+	struct itimerspec its = {
+		.it_interval.tv_sec = CIFSD_HOUSEKEEPING_INTERVAL,
+		.it_value.tv_sec = CIFSD_HOUSEKEEPING_INTERVAL,
+	};
+	struct epoll_event ev, events[4];
+	int efd, sfd, tfd, wdfd, ipc_fd;
+	int i, nr, ret = -EINVAL;
+	uint64_t ticks;
+
+	efd = epoll_create1(EPOLL_CLOEXEC);
+	sfd = signalfd(-1, set, SFD_NONBLOCK | SFD_CLOEXEC);
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	wdfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (efd < 0 || sfd < 0 || tfd < 0 || wdfd < 0) {
+		pr_err("Unable to create main loop fds: %s\n", strerr(errno));
+		goto out;
+	}
+
+	if (timerfd_settime(tfd, 0, &its, NULL)) {
+		pr_err("Unable to arm housekeeping timer: %s\n",
+			strerr(errno));
+		goto out;
+	}
+
+	if (worker_arm_watchdog(wdfd))
+		goto out;
+
+	ipc_fd = ipc_get_fd();
+	ev.events = EPOLLIN;
+	ev.data.fd = sfd;
+	ret = epoll_ctl(efd, EPOLL_CTL_ADD, sfd, &ev);
+	ev.data.fd = tfd;
+	ret |= epoll_ctl(efd, EPOLL_CTL_ADD, tfd, &ev);
+	ev.data.fd = wdfd;
+	ret |= epoll_ctl(efd, EPOLL_CTL_ADD, wdfd, &ev);
+	ev.data.fd = ipc_fd;
+	ret |= epoll_ctl(efd, EPOLL_CTL_ADD, ipc_fd, &ev);
+	if (ret) {
+		pr_err("Unable to set up epoll: %s\n", strerr(errno));
+		ret = -EINVAL;
+		goto out;
+	}
+
+	while (cifsd_health_status & CIFSD_HEALTH_RUNNING) {
+		if (cifsd_health_status & CIFSD_SHOULD_RELOAD_CONFIG) {
+			ret = parse_reload_configs(pwddb, smbconf);
+			if (ret)
+				pr_err("Failed to reload configs. "
+					"Continue with the old one.\n");
+			worker_arm_watchdog(wdfd);
+			cifsd_health_status &= ~CIFSD_SHOULD_RELOAD_CONFIG;
+		}
+
+		if (cifsd_health_status & CIFSD_SHOULD_DUMP_STATS) {
+			worker_process_dump_stats();
+			cifsd_health_status &= ~CIFSD_SHOULD_DUMP_STATS;
+		}
+
+		ret = 0;
+		nr = epoll_wait(efd, events, ARRAY_SIZE(events), -1);
+		if (nr < 0) {
+			if (errno == EINTR)
+				continue;
+			pr_err("epoll_wait() error: %s\n", strerr(errno));
+			ret = -EINVAL;
+			break;
+		}
+
+		for (i = 0; i < nr; i++) {
+			if (events[i].data.fd == sfd) {
+				worker_process_signal(sfd);
+			} else if (events[i].data.fd == tfd) {
+				if (read(tfd, &ticks, sizeof(ticks)) > 0)
+					worker_process_housekeeping();
+			} else if (events[i].data.fd == wdfd) {
+				if (read(wdfd, &ticks, sizeof(ticks)) > 0)
+					wp_watchdog();
+			} else if (events[i].data.fd == ipc_fd) {
+				ret = ipc_process_event();
+			}
+		}
+
+		if (ret == -CIFSD_STATUS_IPC_FATAL_ERROR) {
+			ret = CIFSD_STATUS_IPC_FATAL_ERROR;
+			break;
+		}
+	}
+	worker_process_dump_stats();
+out:
+	if (wdfd >= 0)
+		close(wdfd);
+	if (tfd >= 0)
+		close(tfd);
+	if (sfd >= 0)
+		close(sfd);
+	if (efd >= 0)
+		close(efd);
 	return ret;
 }
 
 static int worker_process_init(void)
 {
+	sigset_t set;
+	gint64 start;
 	int ret;
 
 	setup_signals(child_sig_handler);
 	set_logger_app_name("cifsd-worker");
 
+	ret = worker_block_signals(&set);
+	if (ret)
+		goto out;
+
+	ret = nss_resolver_init();
+	if (ret) {
+		pr_err("Failed to init NSS resolver\n");
+		goto out;
+	}
+
 	ret = usm_init();
 	if (ret) {
 		pr_err("Failed to init user management\n");
@@ -273,11 +496,14 @@ static int worker_process_init(void)
 		goto out;
 	}
 
+	start = g_get_monotonic_time();
 	ret = parse_configs(pwddb, smbconf);
 	if (ret) {
 		pr_err("Failed to parse configuration files\n");
 		goto out;
 	}
+	pr_info("Configuration parsed in %lld ms\n",
+		(long long)(g_get_monotonic_time() - start) / 1000);
 
 	ret = sm_init();
 	if (ret) {
@@ -297,46 +523,52 @@ static int worker_process_init(void)
 		goto out;
 	}
 
+	if (ipc_trace_path) {
+		ret = ipc_trace_open(ipc_trace_path);
+		if (ret)
+			goto out;
+	}
+
 	ret = ipc_init();
 	if (ret) {
 		pr_err("Failed to init IPC subsystem\n");
 		goto out;
 	}
 
-	while (cifsd_health_status & CIFSD_HEALTH_RUNNING) {
-		if (cifsd_health_status & CIFSD_SHOULD_RELOAD_CONFIG) {
-			ret = parse_reload_configs(pwddb, smbconf);
-			if (ret)
-				pr_err("Failed to reload configs. "
-					"Continue with the old one.\n");
-			cifsd_health_status &= ~CIFSD_SHOULD_RELOAD_CONFIG;
-		}
-
-		ret = ipc_process_event();
-		if (ret == -CIFSD_STATUS_IPC_FATAL_ERROR) {
-			ret = CIFSD_STATUS_IPC_FATAL_ERROR;
-			break;
-		}
-	}
+	ret = worker_process_loop(&set);
 out:
 	worker_process_free();
 	return ret;
 }
 
+/*
+ * The child starts with the worker signals blocked, so that a SIGHUP
+ * or SIGUSR1 forwarded before it has set up its signalfd stays
+ * pending instead of hitting the handlers inherited from the manager.
+ */
 static pid_t start_worker_process(worker_fn fn)
 {
+	sigset_t set, old_set;
 	int status = 0;
 	pid_t __pid;
 
-	__pid = fork();
-	if (__pid < 0) {
-		pr_err("Can't fork child process: `%s'\n", strerr(errno));
+	worker_signal_set(&set);
+	if (sigprocmask(SIG_BLOCK, &set, &old_set)) {
+		pr_err("Unable to block signals: %s\n", strerr(errno));
 		return -EINVAL;
 	}
+
+	__pid = fork();
 	if (__pid == 0) {
 		status = fn();
 		exit(status);
 	}
+
+	sigprocmask(SIG_SETMASK, &old_set, NULL);
+	if (__pid < 0) {
+		pr_err("Can't fork child process: `%s'\n", strerr(errno));
+		return -EINVAL;
+	}
 	return __pid;
 }
 
@@ -346,8 +578,12 @@ static int manager_process_init(void)
 	 * Do not chdir() daemon()'d process to '/'.
 	 */
 	int nochdir = 1;
+	sigset_t set;
 
 	setup_signals(manager_sig_handler);
+	/* Forked by start_worker_process() as a systemd service */
+	worker_signal_set(&set);
+	sigprocmask(SIG_UNBLOCK, &set, NULL);
 	if (no_detach == 0) {
 		pr_logger_init(PR_LOGGER_SYSLOG);
 		if (daemon(nochdir, 0) != 0) {
@@ -378,8 +614,11 @@ static int manager_process_init(void)
 		pid_t child;
 
 		child = waitpid(-1, &status, 0);
-		if (cifsd_health_status & CIFSD_SHOULD_RELOAD_CONFIG &&
-				errno == EINTR) {
+		/*
+		 * SIGHUP and SIGUSR1 are forwarded to the worker and
+		 * interrupt waitpid(), that's not an error.
+		 */
+		if (child == -1 && errno == EINTR) {
 			cifsd_health_status &= ~CIFSD_SHOULD_RELOAD_CONFIG;
 			continue;
 		}
@@ -427,6 +666,8 @@ static struct option opts[] = {
 	{"users",	required_argument,	NULL,	'u' },
 	{"systemd",	no_argument,		NULL,	's' },
 	{"nodetach",	optional_argument,	NULL,	'n' },
+	{"ipc-socket",	required_argument,	NULL,	'i' },
+	{"record",	required_argument,	NULL,	'r' },
 	{"help",	no_argument,		NULL,	'h' },
 	{"?",		no_argument,		NULL,	'?' },
 	{"version",	no_argument,		NULL,	'V' },
@@ -444,7 +685,7 @@ int main(int argc, char *argv[])
 
 	opterr = 0;
 	while (1) {
-		c = getopt_long(argc, argv, "n::p:c:u:sVh", opts, NULL);
+		c = getopt_long(argc, argv, "n::p:c:u:i:r:sVh", opts, NULL);
 
 		if (c < 0)
 			break;
@@ -473,6 +714,12 @@ int main(int argc, char *argv[])
 		case 's':
 			systemd_service = 1;
 			break;
+		case 'i':
+			ipc_set_transport(ipc_unix_transport(optarg));
+			break;
+		case 'r':
+			ipc_trace_path = g_strdup(optarg);
+			break;
 		case 'V':
 			show_version();
 			break;
@@ -5,99 +5,461 @@
  *   linux-cifsd-devel@lists.sourceforge.net
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <memory.h>
 #include <glib.h>
 #include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <fcntl.h>
+#include <time.h>
 #include <netlink/netlink.h>
 #include <netlink/msg.h>
 #include <netlink/genl/genl.h>
 #include <netlink/handlers.h>
 #include <linux/genetlink.h>
 #include <netlink/genl/mngt.h>
+#include <netlink/genl/ctrl.h>
 
 #include <linux/cifsd_server.h>
 
 #include <cifsdtools.h>
 #include <ipc.h>
+#include <ipc_transport.h>
+#include <ipc_trace.h>
 #include <worker.h>
 #include <config_parser.h>
 
 static struct nl_sock *sk;
+static struct ipc_transport ipc_netlink_transport;
+static struct ipc_transport *transport = &ipc_netlink_transport;
+
+static int ipc_sent_msgs;
+static int ipc_send_errors;
+static int ipc_send_calls;
+static int ipc_send_timeouts;
+static int ipc_recv_wakeups;
+static int ipc_recv_datagrams;
+static int ipc_recv_overruns;
+static int ipc_recv_dropped;
+/* CPU time the receive loop spent on delivered datagrams */
+static long long ipc_recv_cpu_ns;
+/* Receive time of the current batch, see ipc_process_event() */
+static long long ipc_recv_time;
+
+/* Max message size the running kernel accepts, see ipc_init() */
+static size_t ipc_max_msg_sz = CIFSD_IPC_MIN_MESSAGE_SIZE;
+
+/*
+ * Max size of a single netlink datagram that we can receive: the
+ * largest IPC message plus netlink, genetlink and attribute headers.
+ */
+#define IPC_RX_BUF_SZ		(CIFSD_IPC_MAX_MESSAGE_SIZE + 64)
+/*
+ * kcifsd sends one genetlink frame per datagram, so a handful of
+ * event slots is more than enough. Should we ever see more frames
+ * in one datagram, the extra events are copied out, and queued on
+ * ->overflow so they still reach the workers in order.
+ */
+#define IPC_RX_BUF_MAX_EVENTS	8
+
+struct ipc_rx_buf {
+	struct ipc_rx_buf	*next;
+	int			ref_count;
+	int			num_events;
+	struct cifsd_ipc_msg	events[IPC_RX_BUF_MAX_EVENTS];
+	struct cifsd_ipc_msg	*overflow;
+	struct cifsd_ipc_msg	**overflow_tail;
+	char			data[IPC_RX_BUF_SZ]
+				__attribute__((aligned(NLMSG_ALIGNTO)));
+};
+
+/*
+ * Events point straight into the datagram, so a buffer stays pinned
+ * until the last of its events is processed. We don't copy small
+ * datagrams out to smaller buffers: that would cost a memcpy() per
+ * request on the receive path. The number of pinned buffers is
+ * bounded by the worker queue watermarks anyway.
+ */
+static struct ipc_rx_buf	*rx_buf_pool;
+static int			rx_buf_pool_nr;
+static GMutex			rx_buf_pool_lock;
+
+static struct ipc_rx_buf *ipc_rx_buf_get(void)
+{
+	struct ipc_rx_buf *buf;
+
+	g_mutex_lock(&rx_buf_pool_lock);
+	buf = rx_buf_pool;
+	if (buf) {
+		rx_buf_pool = buf->next;
+		rx_buf_pool_nr--;
+	}
+	g_mutex_unlock(&rx_buf_pool_lock);
+
+	/*
+	 * The pool only grows when all buffers are still referenced
+	 * by the workers, so we don't allocate anything in the steady
+	 * state.
+	 */
+	if (!buf) {
+		buf = malloc(sizeof(struct ipc_rx_buf));
+		if (!buf)
+			return NULL;
+	}
+
+	buf->next = NULL;
+	buf->ref_count = 1;
+	buf->num_events = 0;
+	buf->overflow = NULL;
+	buf->overflow_tail = &buf->overflow;
+	return buf;
+}
+
+static void ipc_rx_buf_put(struct ipc_rx_buf *buf)
+{
+	if (!g_atomic_int_dec_and_test(&buf->ref_count))
+		return;
+
+	g_mutex_lock(&rx_buf_pool_lock);
+	buf->next = rx_buf_pool;
+	rx_buf_pool = buf;
+	rx_buf_pool_nr++;
+	g_mutex_unlock(&rx_buf_pool_lock);
+}
+
+static void ipc_rx_buf_pool_trim(int keep)
+{
+	struct ipc_rx_buf *buf;
+
+	g_mutex_lock(&rx_buf_pool_lock);
+	while (rx_buf_pool && rx_buf_pool_nr > keep) {
+		buf = rx_buf_pool;
+		rx_buf_pool = buf->next;
+		rx_buf_pool_nr--;
+		free(buf);
+	}
+	g_mutex_unlock(&rx_buf_pool_lock);
+}
+
+static void ipc_rx_buf_pool_destroy(void)
+{
+	ipc_rx_buf_pool_trim(0);
+}
+
+/*
+ * Per-thread caches of response messages, one per response type.
+ * Cached messages are not zeroed on allocation: only the fixed part
+ * of the response (->zero_sz bytes) is cleared, so RPC responses
+ * don't memset() the whole 16K payload every time.
+ */
+#define IPC_RESP_CACHE_DEPTH	8
+
+struct ipc_resp_cache_desc {
+	unsigned int		type;
+	size_t			max_sz;
+	size_t			zero_sz;
+	int			hits;
+	int			misses;
+};
+
+static struct ipc_resp_cache_desc resp_cache_desc[] = {
+	{
+		.type		= CIFSD_EVENT_LOGIN_RESPONSE,
+		.max_sz		= sizeof(struct cifsd_login_response),
+		.zero_sz	= sizeof(struct cifsd_login_response),
+	},
+	{
+		/* Veto list and path are small and '\0' separated */
+		.type		= CIFSD_EVENT_SHARE_CONFIG_RESPONSE,
+		.max_sz		= sizeof(struct cifsd_share_config_response) +
+				  1024,
+		.zero_sz	= sizeof(struct cifsd_share_config_response) +
+				  1024,
+	},
+	{
+		.type		= CIFSD_EVENT_TREE_CONNECT_RESPONSE,
+		.max_sz		= sizeof(struct cifsd_tree_connect_response),
+		.zero_sz	= sizeof(struct cifsd_tree_connect_response),
+	},
+	{
+		.type		= CIFSD_EVENT_RPC_RESPONSE,
+		.max_sz		= CIFSD_IPC_MAX_MESSAGE_SIZE,
+		.zero_sz	= sizeof(struct cifsd_rpc_command),
+	},
+};
+
+#define IPC_RESP_CACHE_MAX	ARRAY_SIZE(resp_cache_desc)
+
+/*
+ * Responses are freed by the IPC sender thread, not by the worker that
+ * allocated them. Such messages are pushed onto the owner's ->remote
+ * list and picked up by the owner the next time its cache runs empty.
+ * Every in-flight message holds a reference on the cache, so the cache
+ * outlives its thread until the last response comes back.
+ */
+struct ipc_resp_cache {
+	int			ref_count;
+	struct cifsd_ipc_msg	*remote;
+	int			nr[IPC_RESP_CACHE_MAX];
+	struct cifsd_ipc_msg	*msgs[IPC_RESP_CACHE_MAX][IPC_RESP_CACHE_DEPTH];
+};
+
+static void ipc_resp_cache_unref(struct ipc_resp_cache *cache)
+{
+	struct cifsd_ipc_msg *msg;
+	int i, j;
+
+	if (!g_atomic_int_dec_and_test(&cache->ref_count))
+		return;
+
+	for (i = 0; i < IPC_RESP_CACHE_MAX; i++) {
+		for (j = 0; j < cache->nr[i]; j++)
+			free(cache->msgs[i][j]);
+	}
+	while (cache->remote) {
+		msg = cache->remote;
+		cache->remote = msg->next;
+		free(msg);
+	}
+	free(cache);
+}
+
+static void ipc_resp_cache_free(gpointer data)
+{
+	ipc_resp_cache_unref(data);
+}
+
+static GPrivate resp_cache_key = G_PRIVATE_INIT(ipc_resp_cache_free);
+
+static struct ipc_resp_cache *ipc_resp_cache_get(void)
+{
+	struct ipc_resp_cache *cache = g_private_get(&resp_cache_key);
+
+	if (cache)
+		return cache;
+
+	cache = calloc(1, sizeof(struct ipc_resp_cache));
+	if (cache) {
+		cache->ref_count = 1;
+		g_private_set(&resp_cache_key, cache);
+	}
+	return cache;
+}
+
+/*
+ * Move the responses released by other threads back to the local
+ * cache. Single consumer: we take the whole list at once.
+ */
+static void ipc_resp_cache_reclaim(struct ipc_resp_cache *cache)
+{
+	struct cifsd_ipc_msg *list, *msg;
+	int idx;
+
+	do {
+		list = g_atomic_pointer_get(&cache->remote);
+	} while (list &&
+		 !g_atomic_pointer_compare_and_exchange(&cache->remote,
+							list,
+							NULL));
+
+	while (list) {
+		msg = list;
+		list = msg->next;
+
+		idx = msg->resp_cache - 1;
+		if (cache->nr[idx] < IPC_RESP_CACHE_DEPTH) {
+			cache->msgs[idx][cache->nr[idx]++] = msg;
+			continue;
+		}
+		free(msg);
+	}
+}
+
+static int ipc_resp_cache_lookup(unsigned int type, size_t sz)
+{
+	int i;
+
+	for (i = 0; i < IPC_RESP_CACHE_MAX; i++) {
+		if (resp_cache_desc[i].type != type)
+			continue;
+		if (sz > resp_cache_desc[i].max_sz)
+			return -1;
+		return i;
+	}
+	return -1;
+}
+
+struct cifsd_ipc_msg *ipc_msg_alloc_response(unsigned int type, size_t sz)
+{
+	struct ipc_resp_cache_desc *desc;
+	struct ipc_resp_cache *cache;
+	struct cifsd_ipc_msg *msg;
+	int idx;
+
+	idx = ipc_resp_cache_lookup(type, sz);
+	cache = ipc_resp_cache_get();
+	if (idx < 0 || !cache)
+		return ipc_msg_alloc(sz);
+
+	desc = &resp_cache_desc[idx];
+	if (!cache->nr[idx])
+		ipc_resp_cache_reclaim(cache);
+
+	if (cache->nr[idx]) {
+		g_atomic_int_inc(&desc->hits);
+		msg = cache->msgs[idx][--cache->nr[idx]];
+	} else {
+		g_atomic_int_inc(&desc->misses);
+		msg = malloc(sizeof(struct cifsd_ipc_msg) + desc->max_sz + 1);
+		if (!msg)
+			return NULL;
+	}
+
+	g_atomic_int_inc(&cache->ref_count);
+
+	msg->type = type;
+	msg->sz = sz;
+	msg->next = NULL;
+	msg->rx_buf = NULL;
+	msg->resp_cache = idx + 1;
+	msg->resp_owner = cache;
+	msg->payload = msg->____payload;
+	memset(msg->payload, 0x00, MIN(sz, desc->zero_sz));
+	return msg;
+}
+
+static void ipc_resp_cache_put(struct cifsd_ipc_msg *msg)
+{
+	struct ipc_resp_cache *cache = msg->resp_owner;
+	struct cifsd_ipc_msg *head;
+	int idx = msg->resp_cache - 1;
+
+	if (cache != g_private_get(&resp_cache_key)) {
+		do {
+			head = g_atomic_pointer_get(&cache->remote);
+			msg->next = head;
+		} while (!g_atomic_pointer_compare_and_exchange(&cache->remote,
+								head,
+								msg));
+	} else if (cache->nr[idx] == IPC_RESP_CACHE_DEPTH) {
+		free(msg);
+	} else {
+		cache->msgs[idx][cache->nr[idx]++] = msg;
+	}
+	ipc_resp_cache_unref(cache);
+}
 
 struct cifsd_ipc_msg *ipc_msg_alloc(size_t sz)
 {
 	struct cifsd_ipc_msg *msg;
 	size_t msg_sz = sz + sizeof(struct cifsd_ipc_msg) + 1;
 
-	if (msg_sz > CIFSD_IPC_MAX_MESSAGE_SIZE)
-		pr_err("IPC message is too large: %lu\n", msg_sz);
+	if (sz > ipc_max_msg_sz)
+		pr_err("IPC message is too large: %lu\n", sz);
 
 	msg = calloc(1, msg_sz);
 	if (msg) {
 		msg->sz = sz;
+		msg->payload = msg->____payload;
 	}
 	return msg;
 }
 
 void ipc_msg_free(struct cifsd_ipc_msg *msg)
 {
+	if (!msg)
+		return;
+
+	if (msg->rx_buf) {
+		ipc_rx_buf_put(msg->rx_buf);
+		return;
+	}
+	if (msg->resp_cache) {
+		ipc_resp_cache_put(msg);
+		return;
+	}
 	free(msg);
 }
 
-static int generic_event(int type, void *payload, size_t sz)
+void ipc_dump_stats(void)
 {
-	struct cifsd_ipc_msg *event;
+	int wakeups = g_atomic_int_get(&ipc_recv_wakeups);
+	int datagrams = g_atomic_int_get(&ipc_recv_datagrams);
+	int i;
 
-	event = ipc_msg_alloc(sz);
-	if (!event)
-		return -ENOMEM;
+	pr_info("IPC receive wakeups: %d, datagrams: %d, avg batch: %.2f\n",
+		wakeups,
+		datagrams,
+		wakeups ? (double)datagrams / wakeups : 0.0);
 
-	event->type = type;
-	event->sz = sz;
+	pr_info("IPC receive CPU per datagram: %lld ns\n",
+		datagrams ? ipc_recv_cpu_ns / datagrams : 0);
 
-	memcpy(CIFSD_IPC_MSG_PAYLOAD(event),
-	       payload,
-	       sz);
-	wp_ipc_msg_push(event);
-	return 0;
-}
+	pr_info("IPC receive overruns: %d, dropped frames: %d\n",
+		g_atomic_int_get(&ipc_recv_overruns),
+		g_atomic_int_get(&ipc_recv_dropped));
 
-static int handle_generic_event(struct nl_cache_ops *unused,
-				struct genl_cmd *cmd,
-				struct genl_info *info,
-				void *arg)
-{
-	if (!info->attrs[cmd->c_id])
-		return NL_SKIP;
+	pr_info("IPC sent messages: %d, send calls: %d, send errors: %d, timeouts: %d\n",
+		g_atomic_int_get(&ipc_sent_msgs),
+		g_atomic_int_get(&ipc_send_calls),
+		g_atomic_int_get(&ipc_send_errors),
+		g_atomic_int_get(&ipc_send_timeouts));
+
+	for (i = 0; i < IPC_RESP_CACHE_MAX; i++) {
+		struct ipc_resp_cache_desc *desc = &resp_cache_desc[i];
 
-	return generic_event(cmd->c_id,
-			    nla_data(info->attrs[cmd->c_id]),
-			    nla_len(info->attrs[cmd->c_id]));
+		pr_info("IPC response cache [event %u]: hits %d misses %d\n",
+			desc->type,
+			g_atomic_int_get(&desc->hits),
+			g_atomic_int_get(&desc->misses));
+	}
 }
 
-static int nlink_msg_cb(struct nl_msg *msg, void *arg)
+static int generic_event(struct ipc_rx_buf *buf,
+			 int type,
+			 void *payload,
+			 size_t sz)
 {
-	struct genlmsghdr *gnlh = genlmsg_hdr(nlmsg_hdr(msg));
+	struct cifsd_ipc_msg *event;
 
-	if (gnlh->version != CIFSD_GENL_VERSION) {
-		pr_err("IPC message version mistamtch: %d\n", gnlh->version);
-		return NL_SKIP;
+	ipc_trace_record(type, payload, sz);
+
+	if (buf->num_events == IPC_RX_BUF_MAX_EVENTS) {
+		event = ipc_msg_alloc(sz);
+		if (!event)
+			return -ENOMEM;
+
+		memcpy(CIFSD_IPC_MSG_PAYLOAD(event), payload, sz);
+		event->type = type;
+		event->sz = sz;
+		event->received = ipc_recv_time;
+		event->next = NULL;
+		*buf->overflow_tail = event;
+		buf->overflow_tail = &event->next;
+		return 0;
 	}
 
-#if TRACING_DUMP_NL_MSG
-	nl_msg_dump(msg, stdout);
-#endif
-
-	return genl_handle_msg(msg, NULL);
-}
-
-static int handle_unsupported_event(struct nl_cache_ops *unused,
-				    struct genl_cmd *cmd,
-				    struct genl_info *info,
-				    void *arg)
-{
-	pr_err("Unsupported IPC event %d, ignore.\n", cmd->c_id);
-	return NL_SKIP;
+	/*
+	 * Events are pushed to the workers once the whole receive
+	 * batch has been decoded, see ipc_process_event().
+	 */
+	event = &buf->events[buf->num_events++];
+	event->type = type;
+	event->sz = sz;
+	event->rx_buf = buf;
+	event->resp_cache = 0;
+	event->received = ipc_recv_time;
+	event->payload = payload;
+	g_atomic_int_inc(&buf->ref_count);
+	return 0;
 }
 
 static int ifc_list_size(void)
@@ -121,11 +483,19 @@ static int ipc_cifsd_starting_up(void)
 	struct cifsd_startup_request *ev;
 	struct cifsd_ipc_msg *msg;
 	int ifc_list_sz = 0;
-	int ret;
 
 	if (global_conf.bind_interfaces_only && global_conf.interfaces)
 		ifc_list_sz += ifc_list_size();
 
+	/*
+	 * kcifsd expects the whole startup config in one message, so
+	 * we can't split the interfaces list. Send what fits.
+	 */
+	if (sizeof(*ev) + ifc_list_sz > ipc_max_msg_sz) {
+		pr_err("Interfaces list is too long, it will be truncated\n");
+		ifc_list_sz = ipc_max_msg_sz - sizeof(*ev);
+	}
+
 	msg = ipc_msg_alloc(sizeof(*ev) + ifc_list_sz);
 	if (!msg)
 		return -ENOMEM;
@@ -174,25 +544,29 @@ static int ipc_cifsd_starting_up(void)
 		int sz = 0;
 		char *config_payload = CIFSD_STARTUP_CONFIG_INTERFACES(ev);
 
-		ev->ifc_list_sz = ifc_list_sz;
-
 		for (i = 0; global_conf.interfaces[i] != NULL; i++) {
 			char *ifc = global_conf.interfaces[i];
 
 			ifc = cp_ltrim(ifc);
 			if (!ifc) continue;
 
+			if (sz + strlen(ifc) + 1 > ifc_list_sz) {
+				pr_err("Interface %s is not sent to kcifsd\n",
+					ifc);
+				continue;
+			}
+
 			strcpy(config_payload + sz, ifc);
 			sz += strlen(ifc) + 1;
 		}
 
+		ev->ifc_list_sz = sz;
+
 		global_conf.bind_interfaces_only = 0;
 		cp_group_kv_list_free(global_conf.interfaces);
 	}
 
-	ret = ipc_msg_send(msg);
-	ipc_msg_free(msg);
-	return ret;
+	return ipc_msg_send(msg);
 }
 
 static int ipc_cifsd_shutting_down(void)
@@ -200,268 +574,982 @@ static int ipc_cifsd_shutting_down(void)
 	return 0;
 }
 
+/*
+ * Per-event decode table, indexed by event type. Only events that
+ * kcifsd sends to us are accepted, everything else is dropped by
+ * ipc_handle_frame(). min_sz is the fixed part of the payload, the
+ * handlers check variable length tails themselves.
+ */
+struct ipc_event_desc {
+	unsigned short	min_sz;
+	unsigned short	inbound;
+};
+
+#define IPC_EVENT_IN(t)		{ .min_sz = sizeof(t), .inbound = 1, }
+
+static const struct ipc_event_desc ipc_event_desc[CIFSD_EVENT_MAX] = {
+	[CIFSD_EVENT_HEARTBEAT_REQUEST] =
+		IPC_EVENT_IN(struct cifsd_heartbeat),
+	[CIFSD_EVENT_LOGIN_REQUEST] =
+		IPC_EVENT_IN(struct cifsd_login_request),
+	[CIFSD_EVENT_SHARE_CONFIG_REQUEST] =
+		IPC_EVENT_IN(struct cifsd_share_config_request),
+	[CIFSD_EVENT_TREE_CONNECT_REQUEST] =
+		IPC_EVENT_IN(struct cifsd_tree_connect_request),
+	[CIFSD_EVENT_TREE_DISCONNECT_REQUEST] =
+		IPC_EVENT_IN(struct cifsd_tree_disconnect_request),
+	[CIFSD_EVENT_LOGOUT_REQUEST] =
+		IPC_EVENT_IN(struct cifsd_logout_request),
+	[CIFSD_EVENT_RPC_REQUEST] =
+		IPC_EVENT_IN(struct cifsd_rpc_command),
+};
+
+/*
+ * Every frame carries exactly one attribute, whose type is the event
+ * type (see ipc_msg_prepare()), so there is nothing to gain from
+ * libnl's generic attribute parsing: check the headers and the payload
+ * length against ipc_event_desc[] and queue the payload in place.
+ */
+static int ipc_handle_frame(struct ipc_rx_buf *buf, struct nlmsghdr *nlh)
+{
+	const struct ipc_event_desc *desc;
+	struct genlmsghdr *gnlh;
+	struct nlattr *nla;
+	int len;
+
+	/*
+	 * Anything that is not addressed to our family is a netlink
+	 * control frame (NLMSG_ERROR acks, NLMSG_DONE, etc.)
+	 */
+	if (nlh->nlmsg_type != transport->family_id)
+		return NL_SKIP;
+
+	len = nlh->nlmsg_len - NLMSG_HDRLEN;
+	if (len < (int)(GENL_HDRLEN + NLA_HDRLEN)) {
+		pr_err("Malformed IPC message, ignore.\n");
+		goto out_drop;
+	}
+
+	gnlh = nlmsg_data(nlh);
+	if (gnlh->version != CIFSD_GENL_VERSION) {
+		pr_err("IPC message version mistamtch: %d\n", gnlh->version);
+		goto out_drop;
+	}
+
+#if TRACING_DUMP_NL_MSG
+	pr_hex_dump(nlh, nlh->nlmsg_len);
+#endif
+
+	if (gnlh->cmd >= CIFSD_EVENT_MAX ||
+	    !ipc_event_desc[gnlh->cmd].inbound) {
+		pr_err("Unsupported IPC event %d, ignore.\n", gnlh->cmd);
+		goto out_drop;
+	}
+
+	desc = &ipc_event_desc[gnlh->cmd];
+	nla = (struct nlattr *)((char *)gnlh + GENL_HDRLEN);
+	len -= GENL_HDRLEN;
+	if (nla->nla_type != gnlh->cmd ||
+	    nla->nla_len < NLA_HDRLEN ||
+	    nla->nla_len > len ||
+	    nla->nla_len - NLA_HDRLEN < desc->min_sz) {
+		pr_err("Unable to parse IPC event %d, ignore.\n", gnlh->cmd);
+		goto out_drop;
+	}
+
+	if (!generic_event(buf,
+			   gnlh->cmd,
+			   (char *)nla + NLA_HDRLEN,
+			   nla->nla_len - NLA_HDRLEN))
+		return NL_OK;
+
+out_drop:
+	g_atomic_int_inc(&ipc_recv_dropped);
+	return NL_SKIP;
+}
+
+static long long ipc_thread_cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * We don't use nl_recvmsgs() here: libnl allocates a new nl_msg and
+ * copies every frame out of its receive buffer. Instead we recv() the
+ * datagrams into pooled buffers and hand events over to the workers
+ * with the payload pointing straight into those buffers.
+ *
+ * One call drains up to global_conf.ipc_recv_batch datagrams that are
+ * queued on the socket: recvmmsg() blocks for the first one only.
+ */
 int ipc_process_event(void)
 {
-	int ret = 0;
+	struct ipc_rx_buf *bufs[CIFSD_CONF_MAX_IPC_RECV_BATCH];
+	struct mmsghdr mmsgs[CIFSD_CONF_MAX_IPC_RECV_BATCH];
+	struct iovec iovs[CIFSD_CONF_MAX_IPC_RECV_BATCH];
+	int batch = global_conf.ipc_recv_batch;
+	int i, j, nr, ret = 0;
+	long long cpu_ns;
+
+	if (batch < 1 || batch > CIFSD_CONF_MAX_IPC_RECV_BATCH)
+		batch = CIFSD_CONF_DEFAULT_IPC_RECV_BATCH;
+
+	for (nr = 0; nr < batch; nr++) {
+		bufs[nr] = ipc_rx_buf_get();
+		if (!bufs[nr])
+			break;
+
+		iovs[nr].iov_base = bufs[nr]->data;
+		iovs[nr].iov_len = IPC_RX_BUF_SZ;
+		memset(&mmsgs[nr], 0x00, sizeof(struct mmsghdr));
+		mmsgs[nr].msg_hdr.msg_iov = &iovs[nr];
+		mmsgs[nr].msg_hdr.msg_iovlen = 1;
+	}
 
-	ret = nl_recvmsgs_default(sk);
-	if (ret < 0) {
-		pr_err("Recv() error %s [%d]\n", nl_geterror(ret), ret);
-		return -CIFSD_STATUS_IPC_FATAL_ERROR;
+	if (!nr) {
+		pr_err("Out of memory\n");
+		return -ENOMEM;
+	}
+
+	batch = nr;
+	cpu_ns = ipc_thread_cpu_ns();
+	nr = recvmmsg(transport->fd, mmsgs, batch, MSG_WAITFORONE, NULL);
+	if (nr < 0) {
+		int err = errno;
+
+		nr = 0;
+		/*
+		 * ENOBUFS: the socket receive queue has overflowed and
+		 * the kernel dropped some of its messages. Nothing to
+		 * resync, the queue is usable again, so carry on and let
+		 * kcifsd time out the lost requests.
+		 */
+		if (err == ENOBUFS) {
+			int overruns;
+
+			overruns = g_atomic_int_add(&ipc_recv_overruns, 1) + 1;
+			if (overruns == 1 || !(overruns % 100))
+				pr_err("IPC receive queue overrun (%d so far)\n",
+					overruns);
+			goto out;
+		}
+
+		/* Let the caller look at the pending reload request */
+		if (err != EINTR && err != EAGAIN) {
+			pr_err("Recv() error %s [%d]\n", strerr(err), err);
+			ret = -CIFSD_STATUS_IPC_FATAL_ERROR;
+		}
+		goto out;
+	}
+
+	ipc_recv_time = g_get_monotonic_time();
+	g_atomic_int_inc(&ipc_recv_wakeups);
+	g_atomic_int_add(&ipc_recv_datagrams, nr);
+
+	for (i = 0; i < nr; i++) {
+		struct nlmsghdr *nlh;
+		int len = mmsgs[i].msg_len;
+
+		if (mmsgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+			pr_err("IPC message is too large, ignore.\n");
+			g_atomic_int_inc(&ipc_recv_dropped);
+			continue;
+		}
+
+		nlh = (struct nlmsghdr *)bufs[i]->data;
+		for (; nlmsg_ok(nlh, len); nlh = nlmsg_next(nlh, &len))
+			ipc_handle_frame(bufs[i], nlh);
 	}
+
+	for (i = 0; i < nr; i++) {
+		struct cifsd_ipc_msg *event, *next;
+
+		for (j = 0; j < bufs[i]->num_events; j++)
+			wp_ipc_msg_push(&bufs[i]->events[j]);
+		for (event = bufs[i]->overflow; event; event = next) {
+			next = event->next;
+			wp_ipc_msg_push(event);
+		}
+	}
+	/* Only now, when the whole burst is with the workers */
+	wp_run_inline();
+	ipc_recv_cpu_ns += ipc_thread_cpu_ns() - cpu_ns;
+
+out:
+	for (i = 0; i < batch; i++)
+		ipc_rx_buf_put(bufs[i]);
 	return ret;
 }
 
-static struct nla_policy cifsd_nl_policy[CIFSD_EVENT_MAX] = {
-	[CIFSD_EVENT_UNSPEC] = {
-		.minlen = 0,
-	},
+/*
+ * Netlink, genetlink and attribute headers are built on the stack and
+ * sent together with the message payload in one sendmsg() call, so we
+ * neither allocate an nl_msg nor copy the payload into it.
+ */
+struct ipc_msg_hdr {
+	struct nlmsghdr		nlh;
+	struct genlmsghdr	gnlh;
+	struct nlattr		nla;
+};
 
-	[CIFSD_EVENT_HEARTBEAT_REQUEST] = {
-		.minlen = sizeof(struct cifsd_heartbeat),
-	},
+static void ipc_msg_prepare(struct cifsd_ipc_msg *msg,
+			    struct ipc_msg_hdr *hdr,
+			    struct iovec *iov,
+			    struct msghdr *mh)
+{
+	static const char pad[NLA_ALIGNTO];
+	size_t pad_sz = NLA_ALIGN(msg->sz) - msg->sz;
+
+	memset(hdr, 0x00, sizeof(*hdr));
+	hdr->nlh.nlmsg_len = sizeof(*hdr) + msg->sz + pad_sz;
+	hdr->nlh.nlmsg_type = transport->family_id;
+	/* Nobody waits for kernel ACKs, don't ask for them */
+	hdr->nlh.nlmsg_flags = NLM_F_REQUEST;
+	hdr->nlh.nlmsg_pid = transport->port_id;
+	hdr->gnlh.cmd = msg->type;
+	hdr->gnlh.version = CIFSD_GENL_VERSION;
+	/* Use msg->type as attribute TYPE */
+	hdr->nla.nla_type = msg->type;
+	hdr->nla.nla_len = NLA_HDRLEN + msg->sz;
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof(*hdr);
+	iov[1].iov_base = CIFSD_IPC_MSG_PAYLOAD(msg);
+	iov[1].iov_len = msg->sz;
+
+	memset(mh, 0x00, sizeof(*mh));
+	mh->msg_name = transport->peer;
+	mh->msg_namelen = transport->peer_len;
+	mh->msg_iov = iov;
+	mh->msg_iovlen = 2;
+	if (pad_sz) {
+		iov[2].iov_base = (void *)pad;
+		iov[2].iov_len = pad_sz;
+		mh->msg_iovlen = 3;
+	}
 
-	[CIFSD_EVENT_STARTING_UP] = {
-		.minlen = sizeof(struct cifsd_startup_request),
-	},
+#if TRACING_DUMP_NL_MSG
+	pr_hex_dump(hdr, sizeof(*hdr));
+	pr_hex_dump(CIFSD_IPC_MSG_PAYLOAD(msg), msg->sz);
+#endif
+}
 
-	[CIFSD_EVENT_SHUTTING_DOWN] = {
-		.minlen = sizeof(struct cifsd_startup_request),
-	},
+/*
+ * The IPC socket is non-blocking, because the worker main loop polls
+ * it. Senders, however, want to wait for room for their message rather
+ * than drop it, but not forever: a peer that stops reading would block
+ * the sender, and at startup the whole daemon. Past IPC_SEND_TIMEOUT_MS
+ * the message is dropped with ETIMEDOUT.
+ */
+#define IPC_SEND_TIMEOUT_MS	1000
 
-	[CIFSD_EVENT_LOGIN_REQUEST] = {
-		.minlen = sizeof(struct cifsd_login_request),
-	},
+static int ipc_wait_writable(void)
+{
+	struct pollfd pfd = {
+		.fd = transport->fd,
+		.events = POLLOUT,
+	};
+	int ret;
 
-	[CIFSD_EVENT_LOGIN_RESPONSE] = {
-		.minlen = sizeof(struct cifsd_login_response),
-	},
+	if (errno == EINTR)
+		return 1;
+	if (errno != EAGAIN)
+		return 0;
+
+	ret = poll(&pfd, 1, IPC_SEND_TIMEOUT_MS);
+	if (ret > 0 || (ret < 0 && errno == EINTR))
+		return 1;
+	if (!ret) {
+		g_atomic_int_inc(&ipc_send_timeouts);
+		errno = ETIMEDOUT;
+	}
+	return 0;
+}
 
-	[CIFSD_EVENT_SHARE_CONFIG_REQUEST] = {
-		.minlen = sizeof(struct cifsd_share_config_request),
-	},
+static int ipc_msg_sendmsg(struct cifsd_ipc_msg *msg)
+{
+	struct ipc_msg_hdr hdr;
+	struct iovec iov[3];
+	struct msghdr mh;
+	int ret;
 
-	[CIFSD_EVENT_SHARE_CONFIG_RESPONSE] = {
-		.minlen = sizeof(struct cifsd_share_config_response),
-	},
+	ipc_msg_prepare(msg, &hdr, iov, &mh);
 
-	[CIFSD_EVENT_TREE_CONNECT_REQUEST] = {
-		.minlen = sizeof(struct cifsd_tree_connect_request),
-	},
+	do {
+		ret = sendmsg(transport->fd, &mh, 0);
+	} while (ret < 0 && ipc_wait_writable());
 
-	[CIFSD_EVENT_TREE_CONNECT_RESPONSE] = {
-		.minlen = sizeof(struct cifsd_tree_connect_response),
-	},
+	if (ret < 0) {
+		ret = -errno;
+		g_atomic_int_inc(&ipc_send_errors);
+		pr_err("sendmsg() has failed: %s\n", strerr(-ret));
+		return ret;
+	}
 
-	[CIFSD_EVENT_TREE_DISCONNECT_REQUEST] = {
-		.minlen = sizeof(struct cifsd_tree_disconnect_request),
-	},
+	g_atomic_int_inc(&ipc_sent_msgs);
+	g_atomic_int_inc(&ipc_send_calls);
+	return 0;
+}
 
-	[CIFSD_EVENT_LOGOUT_REQUEST] = {
-		.minlen = sizeof(struct cifsd_logout_request),
-	},
+/*
+ * IPC sender stage. Workers don't write to the netlink socket: they
+ * push their responses onto a lock-free MPSC list and the sender
+ * thread flushes whatever has accumulated with sendmmsg(). The list is
+ * a LIFO stack, the sender takes it over as a whole and reverses it,
+ * so responses are still sent in the order they were queued.
+ *
+ * The sender only sleeps on the eventfd when the list is empty, and
+ * workers only write to the eventfd when the sender is sleeping.
+ */
+#define IPC_TX_BATCH		32
 
-	[CIFSD_EVENT_RPC_REQUEST] = {
-		.minlen = sizeof(struct cifsd_rpc_command),
-	},
+static struct cifsd_ipc_msg	*tx_queue;
+static GThread			*tx_thread;
+static int			tx_efd = -1;
+static int			tx_sleeping;
+static int			tx_stop;
 
-	[CIFSD_EVENT_RPC_RESPONSE] = {
-		.minlen = sizeof(struct cifsd_rpc_command),
-	},
-};
+static void ipc_tx_wakeup(void)
+{
+	uint64_t v = 1;
 
-static struct genl_cmd cifsd_genl_cmds[] = {
-	{
-		.c_id		= CIFSD_EVENT_UNSPEC,
-		.c_attr_policy	= cifsd_nl_policy,
-		.c_msg_parser	= &handle_unsupported_event,
-		.c_maxattr	= CIFSD_EVENT_MAX,
-	},
-	{
-		.c_id		= CIFSD_EVENT_HEARTBEAT_REQUEST,
-		.c_attr_policy	= cifsd_nl_policy,
-		.c_msg_parser	= &handle_generic_event,
-		.c_maxattr	= CIFSD_EVENT_MAX,
-	},
-	{
-		.c_id		= CIFSD_EVENT_STARTING_UP,
-		.c_attr_policy	= cifsd_nl_policy,
-		.c_msg_parser	= &handle_unsupported_event,
-		.c_maxattr	= CIFSD_EVENT_MAX,
-	},
-	{
-		.c_id		= CIFSD_EVENT_SHUTTING_DOWN,
-		.c_attr_policy	= cifsd_nl_policy,
-		.c_msg_parser	= &handle_unsupported_event,
-		.c_maxattr	= CIFSD_EVENT_MAX,
-	},
-	{
-		.c_id		= CIFSD_EVENT_LOGIN_REQUEST,
-		.c_attr_policy	= cifsd_nl_policy,
-		.c_msg_parser	= &handle_generic_event,
-		.c_maxattr	= CIFSD_EVENT_MAX,
-	},
-	{
-		.c_id		= CIFSD_EVENT_LOGIN_RESPONSE,
-		.c_attr_policy	= cifsd_nl_policy,
-		.c_msg_parser	= &handle_unsupported_event,
-		.c_maxattr	= CIFSD_EVENT_MAX,
-	},
-	{
-		.c_id		= CIFSD_EVENT_SHARE_CONFIG_REQUEST,
-		.c_attr_policy	= cifsd_nl_policy,
-		.c_msg_parser	= &handle_generic_event,
-		.c_maxattr	= CIFSD_EVENT_MAX,
-	},
-	{
-		.c_id		= CIFSD_EVENT_SHARE_CONFIG_RESPONSE,
-		.c_attr_policy	= cifsd_nl_policy,
-		.c_msg_parser	= &handle_unsupported_event,
-		.c_maxattr	= CIFSD_EVENT_MAX,
-	},
-	{
-		.c_id		= CIFSD_EVENT_TREE_CONNECT_REQUEST,
-		.c_attr_policy	= cifsd_nl_policy,
-		.c_msg_parser	= &handle_generic_event,
-		.c_maxattr	= CIFSD_EVENT_MAX,
-	},
-	{
-		.c_id		= CIFSD_EVENT_TREE_CONNECT_RESPONSE,
-		.c_attr_policy	= cifsd_nl_policy,
-		.c_msg_parser	= &handle_unsupported_event,
-		.c_maxattr	= CIFSD_EVENT_MAX,
-	},
-	{
-		.c_id		= CIFSD_EVENT_TREE_DISCONNECT_REQUEST,
-		.c_attr_policy	= cifsd_nl_policy,
-		.c_msg_parser	= &handle_generic_event,
-		.c_maxattr	= CIFSD_EVENT_MAX,
-	},
-	{
-		.c_id		= CIFSD_EVENT_LOGOUT_REQUEST,
-		.c_attr_policy	= cifsd_nl_policy,
-		.c_msg_parser	= &handle_generic_event,
-		.c_maxattr	= CIFSD_EVENT_MAX,
-	},
-	{
-		.c_id		= CIFSD_EVENT_RPC_REQUEST,
-		.c_attr_policy	= cifsd_nl_policy,
-		.c_msg_parser	= &handle_generic_event,
-		.c_maxattr	= CIFSD_EVENT_MAX,
-	},
-	{
-		.c_id		= CIFSD_EVENT_RPC_RESPONSE,
-		.c_attr_policy	= cifsd_nl_policy,
-		.c_msg_parser	= &handle_unsupported_event,
-		.c_maxattr	= CIFSD_EVENT_MAX,
-	},
-};
+	if (write(tx_efd, &v, sizeof(v)) < 0)
+		pr_err("Can't wake up IPC sender: %s\n", strerr(errno));
+}
 
-static struct genl_ops cifsd_family_ops = {
-	.o_name = CIFSD_GENL_NAME,
-	.o_cmds = cifsd_genl_cmds,
-	.o_ncmds = ARRAY_SIZE(cifsd_genl_cmds),
-};
+static struct cifsd_ipc_msg *ipc_tx_dequeue_all(void)
+{
+	struct cifsd_ipc_msg *list, *prev = NULL, *next;
+
+	do {
+		list = g_atomic_pointer_get(&tx_queue);
+	} while (list &&
+		 !g_atomic_pointer_compare_and_exchange(&tx_queue,
+							list,
+							NULL));
+
+	while (list) {
+		next = list->next;
+		list->next = prev;
+		prev = list;
+		list = next;
+	}
+	return prev;
+}
+
+static void ipc_tx_flush(struct cifsd_ipc_msg **msgs, int nr)
+{
+	struct ipc_msg_hdr hdrs[IPC_TX_BATCH];
+	struct iovec iovs[IPC_TX_BATCH][3];
+	struct mmsghdr mmsgs[IPC_TX_BATCH];
+	int i, ret, sent = 0;
+
+	for (i = 0; i < nr; i++) {
+		ipc_msg_prepare(msgs[i],
+				&hdrs[i],
+				iovs[i],
+				&mmsgs[i].msg_hdr);
+		mmsgs[i].msg_len = 0;
+	}
+
+	while (sent < nr) {
+		ret = sendmmsg(transport->fd,
+			       &mmsgs[sent],
+			       nr - sent,
+			       0);
+		g_atomic_int_inc(&ipc_send_calls);
+		if (ret < 0) {
+			if (ipc_wait_writable())
+				continue;
+			pr_err("sendmmsg() has failed: %s\n", strerr(errno));
+			/*
+			 * The peer doesn't read, don't wait for it once
+			 * more for every message that is left.
+			 */
+			if (errno == ETIMEDOUT) {
+				g_atomic_int_add(&ipc_send_errors, nr - sent);
+				break;
+			}
+			/* Drop the message that has failed, send the rest */
+			g_atomic_int_inc(&ipc_send_errors);
+			sent++;
+			continue;
+		}
+		g_atomic_int_add(&ipc_sent_msgs, ret);
+		sent += ret;
+	}
+
+	for (i = 0; i < nr; i++)
+		ipc_msg_free(msgs[i]);
+}
+
+static gpointer ipc_tx_thread_fn(gpointer data)
+{
+	struct cifsd_ipc_msg *msgs[IPC_TX_BATCH];
+	struct cifsd_ipc_msg *list;
+	uint64_t v;
+	int nr;
+
+	while (1) {
+		list = ipc_tx_dequeue_all();
+		if (!list) {
+			if (g_atomic_int_get(&tx_stop))
+				break;
+
+			g_atomic_int_set(&tx_sleeping, 1);
+			if (g_atomic_pointer_get(&tx_queue)) {
+				g_atomic_int_set(&tx_sleeping, 0);
+				continue;
+			}
+			if (read(tx_efd, &v, sizeof(v)) < 0 && errno != EINTR)
+				pr_err("IPC sender read() error: %s\n",
+				       strerr(errno));
+			g_atomic_int_set(&tx_sleeping, 0);
+			continue;
+		}
+
+		while (list) {
+			for (nr = 0; list && nr < IPC_TX_BATCH; nr++) {
+				msgs[nr] = list;
+				list = list->next;
+			}
+			ipc_tx_flush(msgs, nr);
+		}
+	}
+	return NULL;
+}
 
 int ipc_msg_send(struct cifsd_ipc_msg *msg)
 {
-	struct nl_msg *nlmsg;
-	struct nlmsghdr *hdr;
-	int ret = -EINVAL;
+	struct cifsd_ipc_msg *head;
+	int ret;
 
-	nlmsg = nlmsg_alloc();
-	if (!nlmsg) {
-		ret = -ENOMEM;
-		goto out_error;
+	if (msg->sz > ipc_max_msg_sz) {
+		pr_err("IPC message is too large: %u, dropped\n", msg->sz);
+		g_atomic_int_inc(&ipc_send_errors);
+		ipc_msg_free(msg);
+		return -EMSGSIZE;
 	}
 
-	nlmsg_set_proto(nlmsg, NETLINK_GENERIC);
-	hdr = genlmsg_put(nlmsg, getpid(), 0, cifsd_family_ops.o_id,
-			  0, 0, msg->type, CIFSD_GENL_VERSION);
-	if (!hdr) {
-		pr_err("genlmsg_put() has failed, aborting IPC send()\n");
-		goto out_error;
+	/* Startup event, or the sender is already gone */
+	if (!tx_thread) {
+		ret = -EINVAL;
+		if (transport->fd >= 0)
+			ret = ipc_msg_sendmsg(msg);
+		ipc_msg_free(msg);
+		return ret;
 	}
 
-	/* Use msg->type as attribute TYPE */
-	ret = nla_put(nlmsg, msg->type, msg->sz, CIFSD_IPC_MSG_PAYLOAD(msg));
-	if (ret) {
-		pr_err("nla_put() has failed, aborting IPC send()\n");
-		goto out_error;
+	do {
+		head = g_atomic_pointer_get(&tx_queue);
+		msg->next = head;
+	} while (!g_atomic_pointer_compare_and_exchange(&tx_queue,
+							head,
+							msg));
+
+	if (g_atomic_int_get(&tx_sleeping) &&
+	    g_atomic_int_compare_and_exchange(&tx_sleeping, 1, 0))
+		ipc_tx_wakeup();
+	return 0;
+}
+
+static void ipc_tx_stop(void)
+{
+	if (tx_thread) {
+		g_atomic_int_set(&tx_stop, 1);
+		ipc_tx_wakeup();
+		g_thread_join(tx_thread);
+		tx_thread = NULL;
 	}
 
-#if TRACING_DUMP_NL_MSG
-	nl_msg_dump(nlmsg, stdout);
+	if (tx_efd >= 0)
+		close(tx_efd);
+	tx_efd = -1;
+}
+
+static int ipc_tx_start(void)
+{
+	tx_efd = eventfd(0, EFD_CLOEXEC);
+	if (tx_efd < 0) {
+		pr_err("Can't create IPC sender eventfd: %s\n",
+		       strerr(errno));
+		return -EINVAL;
+	}
+
+	tx_stop = 0;
+	tx_thread = g_thread_new("cifsd-ipc-tx", ipc_tx_thread_fn, NULL);
+	return 0;
+}
+
+size_t ipc_msg_max_size(void)
+{
+	return ipc_max_msg_sz;
+}
+
+/*
+ * How large frames kcifsd takes depends on its netlink receive path
+ * rather than on the kernel version (backports, out of tree builds),
+ * so ask the kernel once the startup handshake is done: send a frame
+ * padded to the largest message size with NLM_F_ACK, and take 32K
+ * only when the ack reports no error. Anything else, no ack within a
+ * second included, means 16K.
+ *
+ * The probe is a tree connect response for a handle that no request
+ * ever gets: kcifsd drops responses it has no waiter for and acks them
+ * with 0, so the frame has no side effects. It goes out on a socket of
+ * its own, the main socket may already have kcifsd requests queued.
+ */
+#define IPC_PROBE_SEQ		0x43495044	/* "CIPD" */
+#define IPC_PROBE_HANDLE	0xffffffff
+#define IPC_PROBE_TIMEOUT_MS	1000
+
+static int ipc_netlink_probe_ack(int fd)
+{
+	struct pollfd pfd = {
+		.fd = fd,
+		.events = POLLIN,
+	};
+	char buf[NLMSG_HDRLEN + sizeof(struct nlmsgerr)]
+		__attribute__((aligned(NLMSG_ALIGNTO)));
+	gint64 deadline = g_get_monotonic_time() +
+		IPC_PROBE_TIMEOUT_MS * G_TIME_SPAN_MILLISECOND;
+
+	while (1) {
+		struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+		struct nlmsgerr *err = nlmsg_data(nlh);
+		gint64 timeout = deadline - g_get_monotonic_time();
+		int len;
+
+		if (timeout <= 0 ||
+		    poll(&pfd, 1, timeout / G_TIME_SPAN_MILLISECOND) <= 0)
+			return -ETIMEDOUT;
+
+		/* The ack may echo the whole frame, we only need the header */
+		len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT | MSG_TRUNC);
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		if (len < (int)sizeof(buf) ||
+		    nlh->nlmsg_type != NLMSG_ERROR ||
+		    nlh->nlmsg_seq != IPC_PROBE_SEQ)
+			continue;
+		return err->error;
+	}
+}
+
+static int ipc_netlink_probe_send(int fd, int family_id)
+{
+	struct sockaddr_nl peer = {
+		.nl_family = AF_NETLINK,
+	};
+	struct cifsd_tree_connect_response *resp;
+	struct nlmsghdr *nlh;
+	struct genlmsghdr *gnlh;
+	struct nlattr *nla;
+	size_t hdr_sz = NLMSG_HDRLEN + GENL_HDRLEN + NLA_HDRLEN;
+	size_t sz = hdr_sz + CIFSD_IPC_MAX_MESSAGE_SIZE;
+	char *frame;
+	int ret = 0;
+
+	frame = calloc(1, sz);
+	if (!frame)
+		return -ENOMEM;
+
+	nlh = (struct nlmsghdr *)frame;
+	nlh->nlmsg_len = sz;
+	nlh->nlmsg_type = family_id;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	nlh->nlmsg_seq = IPC_PROBE_SEQ;
+
+	gnlh = nlmsg_data(nlh);
+	gnlh->cmd = CIFSD_EVENT_TREE_CONNECT_RESPONSE;
+	gnlh->version = CIFSD_GENL_VERSION;
+
+	/* The response itself, then an unspec attribute as padding */
+	nla = (struct nlattr *)((char *)gnlh + GENL_HDRLEN);
+	nla->nla_type = CIFSD_EVENT_TREE_CONNECT_RESPONSE;
+	nla->nla_len = NLA_HDRLEN + sizeof(*resp);
+	resp = nla_data(nla);
+	resp->handle = IPC_PROBE_HANDLE;
+	nla = (struct nlattr *)((char *)nla + NLA_ALIGN(nla->nla_len));
+	nla->nla_type = 0;
+	nla->nla_len = frame + sz - (char *)nla;
+
+	if (sendto(fd, frame, sz, 0,
+		   (struct sockaddr *)&peer, sizeof(peer)) < 0)
+		ret = -errno;
+	free(frame);
+	return ret;
+}
+
+static void ipc_netlink_probe(struct ipc_transport *t)
+{
+	struct sockaddr_nl local = {
+		.nl_family = AF_NETLINK,
+	};
+	int sndbuf = 2 * IPC_RX_BUF_SZ;
+	int one = 1;
+	int fd, ret;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+	if (fd < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	if (bind(fd, (struct sockaddr *)&local, sizeof(local)) < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+#ifdef NETLINK_CAP_ACK
+	/* Don't have the kernel echo 32K back to us */
+	setsockopt(fd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
 #endif
 
-	nl_complete_msg(sk, nlmsg);
-	ret = nl_send_auto(sk, nlmsg);
-	if (ret > 0)
-		ret = 0;
-	else
-		pr_err("nl_send_auto() has failed: %d\n", ret);
+	ret = ipc_netlink_probe_send(fd, t->family_id);
+	if (!ret)
+		ret = ipc_netlink_probe_ack(fd);
+out:
+	if (fd >= 0)
+		close(fd);
+
+	if (ret) {
+		pr_info("kcifsd doesn't take %d byte messages: %s\n",
+			CIFSD_IPC_MAX_MESSAGE_SIZE, strerr(-ret));
+		return;
+	}
+	t->max_msg_sz = CIFSD_IPC_MAX_MESSAGE_SIZE;
+}
+
+/*
+ * Make sure that the send buffer takes the largest datagram (headers
+ * included, that's IPC_RX_BUF_SZ), and size the receive queue for a
+ * burst of requests: one small request per session, but no less than
+ * a full batch of the largest messages. Requests that don't fit are
+ * dropped by the kernel and we see ENOBUFS.
+ */
+#define IPC_RCVBUF_PER_SESSION	2048
+#define IPC_RCVBUF_MAX		(16 * 1024 * 1024)
+
+static int ipc_set_sock_buffers(int fd)
+{
+	socklen_t len = sizeof(int);
+	int sndbuf = 0;
+	int rcvbuf;
+	long sz;
+
+	if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len) ||
+	    sndbuf < 2 * IPC_RX_BUF_SZ) {
+		sndbuf = 2 * IPC_RX_BUF_SZ;
+		if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF,
+			       &sndbuf, sizeof(sndbuf))) {
+			pr_err("Unable to set send buffer size: %s\n",
+				strerr(errno));
+			return -EINVAL;
+		}
+	}
+
+	sz = (long)global_conf.sessions_cap * IPC_RCVBUF_PER_SESSION;
+	sz = MAX(sz, (long)global_conf.ipc_recv_batch * IPC_RX_BUF_SZ);
+	rcvbuf = MIN(sz, IPC_RCVBUF_MAX);
+
+	/* SO_RCVBUFFORCE ignores rmem_max, but needs CAP_NET_ADMIN */
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE,
+		       &rcvbuf, sizeof(rcvbuf)) &&
+	    setsockopt(fd, SOL_SOCKET, SO_RCVBUF,
+		       &rcvbuf, sizeof(rcvbuf)))
+		pr_err("Unable to set receive buffer size: %s\n",
+			strerr(errno));
+
+	len = sizeof(int);
+	if (!getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &len))
+		pr_info("IPC receive buffer size: %d\n", rcvbuf);
+	return 0;
+}
+
+int ipc_get_fd(void)
+{
+	return transport->fd;
+}
+
+/*
+ * Called periodically from the worker main loop. A burst of requests
+ * may leave lots of receive buffers in the pool; once IPC has been
+ * idle for a whole period, give them back and keep only one batch.
+ */
+void ipc_housekeeping(void)
+{
+	static int last_wakeups;
+	int wakeups = g_atomic_int_get(&ipc_recv_wakeups);
+
+	if (wakeups == last_wakeups)
+		ipc_rx_buf_pool_trim(global_conf.ipc_recv_batch);
+	last_wakeups = wakeups;
+}
+
+/*
+ * Chances are we can start before cifsd kernel module is up and
+ * running. Instead of polling for the CIFSD_GENL family we listen to
+ * the nlctrl "notify" multicast group and retry as soon as the kernel
+ * announces a new family. Polling with exponential backoff is still
+ * there in case the notifications are not available or get lost.
+ */
+#define IPC_RESOLVE_BACKOFF_MIN_MS	50
+#define IPC_RESOLVE_BACKOFF_MAX_MS	5000
+
+static struct nl_sock *ipc_ctrl_notify_open(void)
+{
+	struct nl_sock *nsk;
+	int grp;
+
+	nsk = nl_socket_alloc();
+	if (!nsk)
+		return NULL;
+
+	nl_socket_disable_seq_check(nsk);
+	if (nl_connect(nsk, NETLINK_GENERIC))
+		goto out_error;
+
+	grp = genl_ctrl_resolve_grp(nsk, "nlctrl", "notify");
+	if (grp < 0)
+		goto out_error;
+
+	if (nl_socket_add_membership(nsk, grp))
+		goto out_error;
+
+	if (nl_socket_set_nonblocking(nsk))
+		goto out_error;
+	return nsk;
 
 out_error:
-	if (nlmsg)
-		nlmsg_free(nlmsg);
-	return ret;
+	pr_err("Can't subscribe to nlctrl notifications, will poll\n");
+	nl_socket_free(nsk);
+	return NULL;
 }
 
-void ipc_destroy(void)
+/*
+ * Returns 1 if CTRL_CMD_NEWFAMILY for CIFSD_GENL_NAME has been
+ * received, 0 otherwise.
+ */
+static int ipc_ctrl_notify_process(struct nl_sock *nsk)
 {
-	if (cifsd_health_status & CIFSD_HEALTH_RUNNING) {
-		ipc_cifsd_shutting_down();
-		genl_unregister_family(&cifsd_family_ops);
+	static char buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+	struct genlmsghdr *gnlh;
+	struct nlmsghdr *nlh;
+	struct nlattr *nla;
+	int len, found = 0;
+
+	while ((len = recv(nl_socket_get_fd(nsk), buf, sizeof(buf), 0)) > 0) {
+		nlh = (struct nlmsghdr *)buf;
+		for (; nlmsg_ok(nlh, len); nlh = nlmsg_next(nlh, &len)) {
+			if (!genlmsg_valid_hdr(nlh, 0))
+				continue;
+
+			gnlh = nlmsg_data(nlh);
+			if (gnlh->cmd != CTRL_CMD_NEWFAMILY)
+				continue;
+
+			nla = nla_find(genlmsg_attrdata(gnlh, 0),
+				       genlmsg_attrlen(gnlh, 0),
+				       CTRL_ATTR_FAMILY_NAME);
+			if (nla && !strcmp(nla_get_string(nla),
+					   CIFSD_GENL_NAME))
+				found = 1;
+		}
 	}
+	return found;
+}
 
+/* Only used to resolve the family id, frames are decoded by hand */
+static struct genl_ops cifsd_family_ops = {
+	.o_name = CIFSD_GENL_NAME,
+};
+
+/*
+ * The worker blocks termination signals and handles them from its
+ * main loop, which isn't running yet. Watch them with a signalfd,
+ * without consuming, so we don't sleep through a shutdown request.
+ */
+static int ipc_wait_for_kcifsd(void)
+{
+	struct nl_sock *nsk;
+	struct pollfd pfd[2];
+	sigset_t set;
+	int backoff = IPC_RESOLVE_BACKOFF_MIN_MS;
+	int nfds = 1, ret;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGQUIT);
+
+	pfd[0].fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+	pfd[0].events = POLLIN;
+	if (pfd[0].fd < 0) {
+		pr_err("Can't create signalfd: %s\n", strerr(errno));
+		return -EINVAL;
+	}
+
+	/* Subscribe before the first resolve, not to miss the event */
+	nsk = ipc_ctrl_notify_open();
+	if (nsk) {
+		pfd[1].fd = nl_socket_get_fd(nsk);
+		pfd[1].events = POLLIN;
+		nfds = 2;
+	}
+
+	while (1) {
+		ret = genl_ops_resolve(sk, &cifsd_family_ops);
+		if (!ret)
+			break;
+
+		if (backoff == IPC_RESOLVE_BACKOFF_MIN_MS)
+			pr_info("Waiting for kcifsd to register netlink family\n");
+
+		ret = poll(pfd, nfds, backoff);
+		if (ret < 0 && errno != EINTR) {
+			pr_err("poll() error: %s\n", strerr(errno));
+			ret = -EINVAL;
+			break;
+		}
+
+		if (ret > 0 && pfd[0].revents) {
+			ret = -EINTR;
+			break;
+		}
+
+		if (ret > 0 && nfds == 2 && pfd[1].revents &&
+		    ipc_ctrl_notify_process(nsk)) {
+			backoff = IPC_RESOLVE_BACKOFF_MIN_MS;
+			continue;
+		}
+
+		backoff = MIN(backoff * 2, IPC_RESOLVE_BACKOFF_MAX_MS);
+	}
+
+	nl_socket_free(nsk);
+	close(pfd[0].fd);
+	return ret;
+}
+
+static void ipc_netlink_destroy(struct ipc_transport *t)
+{
 	nl_socket_free(sk);
 	sk = NULL;
+	t->fd = -1;
 }
 
-int ipc_init(void)
+static int ipc_netlink_init(struct ipc_transport *t)
 {
-	int ret;
+	static struct sockaddr_nl peer = {
+		.nl_family = AF_NETLINK,
+	};
 
 	sk = nl_socket_alloc();
 	if (!sk) {
 		pr_err("Cannot allocate netlink socket\n");
-		goto out_error;
+		return -ENOMEM;
 	}
 
 	nl_socket_disable_seq_check(sk);
-	if (nl_socket_modify_cb(sk, NL_CB_VALID, NL_CB_CUSTOM,
-				nlink_msg_cb, NULL))
-		goto out_error;
 
 	if (nl_connect(sk, NETLINK_GENERIC)) {
 		pr_err("Cannot connect to generic netlink.\n");
-		goto out_error;
+		return -EINVAL;
 	}
 
-	if (genl_register_family(&cifsd_family_ops)) {
-		pr_err("Cannot register netlink family\n");
+	if (ipc_wait_for_kcifsd()) {
+		pr_err("Cannot resolve netlink family\n");
+		return -EINVAL;
+	}
+
+	t->fd = nl_socket_get_fd(sk);
+	t->family_id = cifsd_family_ops.o_id;
+	t->port_id = nl_socket_get_local_port(sk);
+	t->peer = (struct sockaddr *)&peer;
+	t->peer_len = sizeof(peer);
+	/* Until ->probe() finds out more */
+	t->max_msg_sz = CIFSD_IPC_MIN_MESSAGE_SIZE;
+	return 0;
+}
+
+static struct ipc_transport ipc_netlink_transport = {
+	.name		= "netlink",
+	.init		= ipc_netlink_init,
+	.destroy	= ipc_netlink_destroy,
+	.probe		= ipc_netlink_probe,
+	.fd		= -1,
+};
+
+void ipc_set_transport(struct ipc_transport *t)
+{
+	transport = t;
+}
+
+void ipc_destroy(void)
+{
+	if (cifsd_health_status & CIFSD_HEALTH_RUNNING)
+		ipc_cifsd_shutting_down();
+
+	ipc_tx_stop();
+	transport->destroy(transport);
+	ipc_rx_buf_pool_destroy();
+}
+
+int ipc_init(void)
+{
+	gint64 start = g_get_monotonic_time();
+	int flags, sock_ok;
+
+	if (transport->init(transport))
 		goto out_error;
+
+	ipc_max_msg_sz = MIN(transport->max_msg_sz,
+			     CIFSD_IPC_MAX_MESSAGE_SIZE);
+	pr_info("IPC transport: %s, max message size: %zu\n",
+		transport->name, ipc_max_msg_sz);
+
+	sock_ok = !ipc_set_sock_buffers(transport->fd);
+	if (!sock_ok) {
+		ipc_max_msg_sz = CIFSD_IPC_MIN_MESSAGE_SIZE;
+		pr_info("IPC max message size: %zu\n", ipc_max_msg_sz);
 	}
 
-	do {
-		/*
-		 * Chances are we can start before cifsd kernel module is up
-		 * and running. So just wait for the kcifsd to register the
-		 * netlink family and accept our connection.
-		 */
-		ret = genl_ops_resolve(sk, &cifsd_family_ops);
-		if (ret) {
-			pr_err("Cannot resolve netlink family\n");
-			sleep(5);
-		}
-	} while (ret);
+	/* The worker main loop polls the socket */
+	flags = fcntl(transport->fd, F_GETFL);
+	if (flags < 0 ||
+	    fcntl(transport->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		pr_err("Cannot make IPC socket non-blocking\n");
+		goto out_error;
+	}
 
 	if (ipc_cifsd_starting_up()) {
 		pr_err("Unable to send startup event\n");
 		return -EINVAL;
 	}
 
+	/* The startup event itself is cut to fit the conservative limit */
+	if (transport->probe && sock_ok) {
+		transport->probe(transport);
+		ipc_max_msg_sz = MIN(transport->max_msg_sz,
+				     CIFSD_IPC_MAX_MESSAGE_SIZE);
+		pr_info("IPC max message size: %zu\n", ipc_max_msg_sz);
+	}
+
+	if (ipc_tx_start())
+		goto out_error;
+
 	cifsd_health_status = CIFSD_HEALTH_RUNNING;
+	pr_info("IPC is ready in %lld ms\n",
+		(long long)(g_get_monotonic_time() - start) / 1000);
 	return 0;
 
 out_error:
@@ -0,0 +1,93 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2018 Samsung Electronics Co., Ltd.
+ *
+ *   linux-cifsd-devel@lists.sourceforge.net
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <cifsdtools.h>
+#include <ipc_trace.h>
+
+/*
+ * Records are written by the IPC receive loop only, so a plain stdio
+ * stream is good enough: no locking, and the libc buffer batches the
+ * writes. The stream is flushed by the housekeeping timer.
+ */
+static FILE *trace;
+
+int ipc_trace_open(const char *path)
+{
+	struct cifsd_ipc_trace_hdr hdr = {
+		.magic = CIFSD_IPC_TRACE_MAGIC,
+		.version = CIFSD_IPC_TRACE_VERSION,
+	};
+	int fd;
+
+	/*
+	 * Login and RPC payloads end up in there: owner only, also when
+	 * we overwrite an existing file.
+	 */
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0 || fchmod(fd, 0600)) {
+		pr_err("Can't open IPC trace file %s: %s\n",
+			path, strerr(errno));
+		if (fd >= 0)
+			close(fd);
+		return -EINVAL;
+	}
+
+	trace = fdopen(fd, "w");
+	if (!trace) {
+		pr_err("Can't open IPC trace file %s: %s\n",
+			path, strerr(errno));
+		close(fd);
+		return -EINVAL;
+	}
+
+	if (fwrite(&hdr, sizeof(hdr), 1, trace) != 1) {
+		pr_err("Can't write IPC trace file %s\n", path);
+		ipc_trace_close();
+		return -EINVAL;
+	}
+
+	pr_info("Recording IPC trace to %s\n", path);
+	return 0;
+}
+
+void ipc_trace_record(unsigned int type, void *payload, size_t sz)
+{
+	struct cifsd_ipc_trace_rec rec;
+
+	if (!trace)
+		return;
+
+	rec.ts = g_get_monotonic_time();
+	rec.type = type;
+	rec.sz = sz;
+
+	if (fwrite(&rec, sizeof(rec), 1, trace) != 1 ||
+	    (sz && fwrite(payload, sz, 1, trace) != 1)) {
+		pr_err("Can't write IPC trace, recording stopped\n");
+		ipc_trace_close();
+	}
+}
+
+void ipc_trace_flush(void)
+{
+	if (trace)
+		fflush(trace);
+}
+
+void ipc_trace_close(void)
+{
+	if (trace)
+		fclose(trace);
+	trace = NULL;
+}
@@ -0,0 +1,79 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2018 Samsung Electronics Co., Ltd.
+ *
+ *   linux-cifsd-devel@lists.sourceforge.net
+ */
+
+#include <memory.h>
+#include <glib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/genetlink.h>
+
+#include <cifsdtools.h>
+#include <ipc.h>
+#include <ipc_transport.h>
+
+/*
+ * UNIX SOCK_SEQPACKET transport. cifsd connects to a listening socket
+ * and exchanges exactly the same generic netlink frames with whatever
+ * sits on the other end, normally the cifsdbench fake kernel. There is
+ * no family to resolve: both sides use GENL_MIN_ID.
+ */
+static char *unix_path;
+
+static void ipc_unix_destroy(struct ipc_transport *t)
+{
+	if (t->fd >= 0)
+		close(t->fd);
+	t->fd = -1;
+}
+
+static int ipc_unix_init(struct ipc_transport *t)
+{
+	struct sockaddr_un addr;
+
+	if (strlen(unix_path) >= sizeof(addr.sun_path)) {
+		pr_err("IPC socket path is too long: %s\n", unix_path);
+		return -EINVAL;
+	}
+
+	t->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (t->fd < 0) {
+		pr_err("Cannot create IPC socket: %s\n", strerr(errno));
+		return -EINVAL;
+	}
+
+	memset(&addr, 0x00, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, unix_path);
+
+	if (connect(t->fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		pr_err("Cannot connect to %s: %s\n", unix_path, strerr(errno));
+		return -EINVAL;
+	}
+
+	t->family_id = GENL_MIN_ID;
+	t->port_id = getpid();
+	t->peer = NULL;
+	t->peer_len = 0;
+	t->max_msg_sz = CIFSD_IPC_MAX_MESSAGE_SIZE;
+	return 0;
+}
+
+static struct ipc_transport ipc_unix = {
+	.name		= "unix",
+	.init		= ipc_unix_init,
+	.destroy	= ipc_unix_destroy,
+	.fd		= -1,
+};
+
+struct ipc_transport *ipc_unix_transport(const char *path)
+{
+	g_free(unix_path);
+	unix_path = g_strdup(path);
+	return &ipc_unix;
+}
@@ -0,0 +1,89 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2018 Samsung Electronics Co., Ltd.
+ *
+ *   linux-cifsd-devel@lists.sourceforge.net
+ */
+
+#include <stddef.h>
+#include <errno.h>
+
+#include <cifsdtools.h>
+#include <malloc_stats.h>
+
+/*
+ * Debugging aid: interpose the libc allocator in the cifsd binary, so
+ * that allocations made by glib and libnl are counted as well, and
+ * hand the calls over to glibc's own implementation.
+ */
+extern void *__libc_malloc(size_t sz);
+extern void *__libc_calloc(size_t nmemb, size_t sz);
+extern void *__libc_realloc(void *ptr, size_t sz);
+extern void *__libc_memalign(size_t align, size_t sz);
+extern void *__libc_valloc(size_t sz);
+extern void *__libc_pvalloc(size_t sz);
+
+static __thread unsigned long malloc_calls
+	__attribute__((tls_model("initial-exec")));
+
+void *malloc(size_t sz)
+{
+	malloc_calls++;
+	return __libc_malloc(sz);
+}
+
+void *calloc(size_t nmemb, size_t sz)
+{
+	malloc_calls++;
+	return __libc_calloc(nmemb, sz);
+}
+
+void *realloc(void *ptr, size_t sz)
+{
+	malloc_calls++;
+	return __libc_realloc(ptr, sz);
+}
+
+void *memalign(size_t align, size_t sz)
+{
+	malloc_calls++;
+	return __libc_memalign(align, sz);
+}
+
+void *aligned_alloc(size_t align, size_t sz)
+{
+	malloc_calls++;
+	return __libc_memalign(align, sz);
+}
+
+int posix_memalign(void **ptr, size_t align, size_t sz)
+{
+	void *p;
+
+	if (!align || align % sizeof(void *) || (align & (align - 1)))
+		return EINVAL;
+
+	malloc_calls++;
+	p = __libc_memalign(align, sz);
+	if (!p)
+		return ENOMEM;
+	*ptr = p;
+	return 0;
+}
+
+void *valloc(size_t sz)
+{
+	malloc_calls++;
+	return __libc_valloc(sz);
+}
+
+void *pvalloc(size_t sz)
+{
+	malloc_calls++;
+	return __libc_pvalloc(sz);
+}
+
+unsigned long malloc_stats_calls(void)
+{
+	return malloc_calls;
+}
@@ -15,6 +15,7 @@
 #include <rpc_srvsvc.h>
 #include <rpc_wkssvc.h>
 #include <cifsdtools.h>
+#include <worker.h>
 
 static GHashTable	*pipes_table;
 static GRWLock		pipes_table_lock;
@@ -246,15 +247,23 @@ static void __clear_pipes_table(void)
 
 static void align_offset(struct cifsd_dcerpc *dce, size_t n)
 {
-	dce->offset = __ALIGN(dce->offset, n);
+	size_t offset = __ALIGN(dce->offset, n);
+
+	/*
+	 * Response buffers are not zeroed on allocation, make sure we
+	 * don't put stale data into alignment padding.
+	 */
+	if (offset != dce->offset && offset <= dce->payload_sz)
+		memset(PAYLOAD_HEAD(dce), 0x00, offset - dce->offset);
+	dce->offset = offset;
 }
 
 static void auto_align_offset(struct cifsd_dcerpc *dce)
 {
 	if (dce->flags & CIFSD_DCERPC_ALIGN8) {
-		dce->offset = __ALIGN(dce->offset, 8);
+		align_offset(dce, 8);
 	} else if (dce->flags & CIFSD_DCERPC_ALIGN4) {
-		dce->offset = __ALIGN(dce->offset, 4);
+		align_offset(dce, 4);
 	}
 }
 
@@ -383,11 +392,69 @@ int ndr_read_bytes(struct cifsd_dcerpc *dce, void *value, size_t sz)
 	return 0;
 }
 
+/*
+ * iconv descriptors from the default charset, opened on first use and
+ * kept per thread. g_convert() opens and closes one for every string,
+ * which is most of what a share enumeration used to allocate.
+ */
+struct ndr_iconv {
+	GIConv		cd[CIFSD_CHARSET_MAX];
+};
+
+static void ndr_iconv_free(gpointer data)
+{
+	struct ndr_iconv *conv = data;
+	int i;
+
+	for (i = 0; i < CIFSD_CHARSET_MAX; i++) {
+		if (conv->cd[i] != (GIConv)-1)
+			g_iconv_close(conv->cd[i]);
+	}
+	g_free(conv);
+}
+
+static GPrivate ndr_iconv_key = G_PRIVATE_INIT(ndr_iconv_free);
+
+static GIConv ndr_iconv_open(int charset)
+{
+	struct ndr_iconv *conv = g_private_get(&ndr_iconv_key);
+	GIConv cd;
+	int i;
+
+	if (!conv) {
+		conv = g_malloc(sizeof(*conv));
+		for (i = 0; i < CIFSD_CHARSET_MAX; i++)
+			conv->cd[i] = (GIConv)-1;
+		g_private_set(&ndr_iconv_key, conv);
+	}
+
+	if (conv->cd[charset] != (GIConv)-1)
+		return conv->cd[charset];
+
+	cd = g_iconv_open(cifsd_conv_charsets[charset],
+			  cifsd_conv_charsets[CIFSD_CHARSET_DEFAULT]);
+	/* Same fallback as cifsd_gconvert(): UTF-16 may only be known as UCS-2 */
+	if (cd == (GIConv)-1 && (charset == CIFSD_CHARSET_UTF16LE ||
+				 charset == CIFSD_CHARSET_UTF16BE))
+		cd = g_iconv_open(cifsd_conv_charsets[charset + 1],
+				  cifsd_conv_charsets[CIFSD_CHARSET_DEFAULT]);
+	if (cd == (GIConv)-1) {
+		pr_err("Can't convert strings to %s\n",
+			cifsd_conv_charsets[charset]);
+		return cd;
+	}
+
+	conv->cd[charset] = cd;
+	return cd;
+}
+
 int ndr_write_vstring(struct cifsd_dcerpc *dce, char *value)
 {
-	gchar *out;
-	gsize bytes_read = 0;
-	gsize bytes_written = 0;
+	GIConv cd;
+	gchar *in, *out, *head;
+	gchar *heap_out = NULL;
+	gsize in_left, out_left;
+	gsize bytes_written;
 
 	size_t raw_len;
 	char *raw_value = value;
@@ -404,14 +471,31 @@ int ndr_write_vstring(struct cifsd_dcerpc *dce, char *value)
 	if (dce->flags & CIFSD_DCERPC_ASCII_STRING)
 		charset = CIFSD_CHARSET_UTF8;
 
-	out = cifsd_gconvert(raw_value,
-			     raw_len,
-			     charset,
-			     CIFSD_CHARSET_DEFAULT,
-			     &bytes_read,
-			     &bytes_written);
+	cd = ndr_iconv_open(charset);
+	if (cd == (GIConv)-1)
+		return -EINVAL;
+
+	/*
+	 * The converted string only lives until it is copied to the
+	 * payload. UTF-16 takes at most two bytes per UTF-8 byte.
+	 */
+	out_left = raw_len * 2;
+	out = wp_arena_alloc(out_left);
+	if (!out)
+		out = heap_out = g_try_malloc(out_left);
 	if (!out)
+		return -ENOMEM;
+
+	in = raw_value;
+	in_left = raw_len;
+	head = out;
+	g_iconv(cd, NULL, NULL, NULL, NULL);
+	if (g_iconv(cd, &in, &in_left, &head, &out_left) == (gsize)-1) {
+		pr_err("Can't convert string: %s\n", strerr(errno));
+		g_free(heap_out);
 		return -EINVAL;
+	}
+	bytes_written = head - out;
 
 	/*
 	 * NDR represents a conformant and varying string as an ordered
@@ -428,8 +512,7 @@ int ndr_write_vstring(struct cifsd_dcerpc *dce, char *value)
 	ret |= ndr_write_int32(dce, raw_len);
 	ret |= ndr_write_bytes(dce, out, bytes_written);
 	auto_align_offset(dce);
-
-	g_free(out);
+	g_free(heap_out);
 	return ret;
 }
 
@@ -7,19 +7,324 @@
 #include <memory.h>
 #include <glib.h>
 #include <errno.h>
+#include <unistd.h>
 #include <linux/cifsd_server.h>
 
 #include <cifsdtools.h>
 #include <worker.h>
 #include <ipc.h>
 #include <rpc.h>
+#include <malloc_stats.h>
 
 #include <management/user.h>
 #include <management/share.h>
 #include <management/tree_conn.h>
 
-#define MAX_WORKER_THREADS	4
-static GThreadPool *pool;
+/*
+ * Requests are spread over a set of shards, each one served by its own
+ * thread. Requests for the same RPC pipe always go to the same shard
+ * lane, so they are handled one at a time and in the order kcifsd sent
+ * them: a pipe needs no locking against concurrent requests of its own.
+ * A pipe is bound to the shard with the fewest open pipes when it is
+ * opened, and stays there until it is closed or the open fails, also
+ * when the pool is resized.
+ *
+ * Tree connects and disconnects of one session are kept in order the
+ * same way, but a session is bound to a shard only while it has such
+ * requests queued or running: kcifsd tells us when a tree goes away,
+ * but a logout carries no session id, so a binding that outlived its
+ * requests could never be dropped. Logouts need no ordering, there is
+ * nothing to do for them.
+ *
+ * The price is head-of-line blocking: a shard runs one request at a
+ * time, so a pipe waits for whatever its shard is busy with, a login
+ * or a share config request stuck in an NSS lookup (up to
+ * NSS_RESOLVE_TIMEOUT) included. That is why sessions are bound for
+ * as short as possible.
+ *
+ * Requests that carry no such state (logins, share config lookups) go
+ * to the shard's work-stealing deque instead,
+ * preferably of an idle shard, and any shard that runs out of work
+ * steals them from its peers. The IPC receive thread is the only one
+ * that pushes to the deques and the workers only ever steal, so a
+ * Chase-Lev deque without the owner's pop end is enough: push and
+ * steal are lock-free.
+ *
+ * Both lanes and deques come in priority classes: kcifsd gives up on
+ * the whole server if a login or a tree connect is not answered within
+ * `ipc timeout', so those must never wait behind a burst of browsing
+ * RPCs. A class that has been passed over WP_CLASS_MAX_PASSED times in
+ * a row goes first next time, so lower classes still make progress.
+ */
+enum {
+	WP_CLASS_AUTH = 0,
+	WP_CLASS_SHARE,
+	WP_CLASS_RPC,
+	WP_NR_CLASSES,
+};
+
+#define WP_CLASS_MAX_PASSED	16
+
+#define WP_DEQUE_SZ		256
+#define WP_DEQUE_MASK		(WP_DEQUE_SZ - 1)
+
+struct wp_deque {
+	int		top;
+	int		bottom;
+	void		*slots[WP_DEQUE_SZ];
+};
+
+/* Shard states, see wp_resize() */
+enum {
+	WP_SHARD_RUNNING = 0,
+	WP_SHARD_RETIRING,
+	WP_SHARD_EXITED,
+};
+
+struct wp_shard {
+	int		id;
+	GThread		*thread;
+	int		state;
+	/* Protected by wp_keys_lock */
+	int		nr_pipes;
+	int		nr_sessions;
+	int		stop_sent;
+	/* Wake up and stop tokens */
+	GAsyncQueue	*queue;
+	GAsyncQueue	*lanes[WP_NR_CLASSES];
+	struct wp_deque	deques[WP_NR_CLASSES];
+	/* Set while the thread sleeps on its queue */
+	int		idle;
+	/* Only touched by the shard thread */
+	int		passed[WP_NR_CLASSES];
+
+	/*
+	 * Heap allocations made while handling requests, by event type.
+	 * 64 bits wide, so the lock is only there for wp_dump_stats().
+	 */
+	GMutex		malloc_lock;
+	gint64		malloc_calls[CIFSD_EVENT_MAX];
+	gint64		malloc_requests[CIFSD_EVENT_MAX];
+
+	/*
+	 * Progress heartbeat: bumped when the thread picks up a request
+	 * and again when it is done with it, so it is odd while a request
+	 * is in the works. The event type and the handler stage tell the
+	 * watchdog what the thread is busy with.
+	 */
+	int		progress;
+	int		event_type;
+	const char	*stage;
+	/* Only touched by the watchdog */
+	int		seen_progress;
+	long long	seen_since;
+	int		stalled;
+};
+
+/*
+ * Slots are filled on demand and never freed before wp_destroy(), so
+ * the workers can look at any shard below nr_shards without locking.
+ * Slots from nr_shards up hold retired shards, if any.
+ */
+static struct wp_shard *shards[CIFSD_CONF_MAX_WORKER_THREADS];
+static int nr_shards;
+/*
+ * RPC pipe handle to shard, and session id to struct wp_session. Looked
+ * up and bound by the IPC receive thread, released by the workers.
+ */
+static GHashTable *wp_pipes;
+static GHashTable *wp_sessions;
+static GMutex wp_keys_lock;
+
+struct wp_session {
+	guint64			id;
+	struct wp_shard		*shard;
+	/* Requests queued or running */
+	int			inflight;
+};
+/* Next shard to try for stealable requests */
+static int wp_next_shard;
+
+/* Pushed to a shard queue to stop its thread, or to wake it up */
+static char wp_shard_stop;
+static char wp_shard_kick;
+
+static int wp_inline_events;
+static int wp_pooled_events;
+static int wp_stolen_events;
+/* Deepest shard queue seen so far, only touched by the IPC receiver */
+static unsigned int wp_max_queue_depth;
+
+/* Queue wait histograms, bucket N counts waits under 2^N usec */
+#define WP_WAIT_BUCKETS		24
+
+static int wp_queue_wait[WP_NR_CLASSES][WP_WAIT_BUCKETS];
+
+/*
+ * How long kcifsd waits for a response when `ipc timeout' is not set,
+ * in seconds.
+ */
+#define WP_DEFAULT_DEADLINE	2
+
+/* Shortest watchdog period, in milliseconds */
+#define WP_WATCHDOG_MIN_INTERVAL	10
+
+/* Requests dropped past their deadline, by event type */
+static int wp_expired_events[CIFSD_EVENT_MAX];
+
+/*
+ * Requests queued, but not picked up by a worker yet, by class. Once a
+ * class reaches the high watermark its new requests get an error
+ * response straight from the IPC receive thread, until it drops to the
+ * low watermark. Each class is bounded on its own, so a flood of RPCs
+ * does not turn logins away.
+ */
+static int wp_queued[WP_NR_CLASSES];
+/* Only touched by the IPC receive thread */
+static int wp_saturated[WP_NR_CLASSES];
+static unsigned int wp_saturations[WP_NR_CLASSES];
+/* Requests answered busy, by event type */
+static int wp_rejected_events[CIFSD_EVENT_MAX];
+
+/*
+ * Per-worker bump arena for request-scoped temporaries. Whatever is
+ * allocated from it is released all at once when worker_pool_fn() is
+ * done with the request; one standard chunk stays around between
+ * requests, so a request whose temporaries fit in it makes no arena
+ * malloc() calls.
+ */
+#define WP_ARENA_CHUNK_SZ	(64 * 1024)
+#define WP_ARENA_ALIGN		16
+
+struct wp_arena_chunk {
+	struct wp_arena_chunk	*next;
+	size_t			sz;
+	size_t			used;
+	char			data[0] __attribute__((aligned(WP_ARENA_ALIGN)));
+};
+
+static __thread struct wp_arena_chunk *wp_arena;
+
+/* Worker stalls seen by the watchdog, by event type */
+static int wp_stalls[CIFSD_EVENT_MAX];
+/* In ms, only touched by the main loop */
+static long long wp_max_stall;
+
+/* The shard of the calling worker thread */
+static __thread struct wp_shard *wp_self;
+
+/* Returns 0 for requests that don't belong to a session */
+static int wp_session_id(struct cifsd_ipc_msg *msg, guint64 *id)
+{
+	void *payload = CIFSD_IPC_MSG_PAYLOAD(msg);
+
+	switch (msg->type) {
+	case CIFSD_EVENT_TREE_CONNECT_REQUEST:
+		if (msg->sz < sizeof(struct cifsd_tree_connect_request))
+			return 0;
+		*id = ((struct cifsd_tree_connect_request *)payload)->session_id;
+		return 1;
+
+	case CIFSD_EVENT_TREE_DISCONNECT_REQUEST:
+		if (msg->sz < sizeof(struct cifsd_tree_disconnect_request))
+			return 0;
+		*id = ((struct cifsd_tree_disconnect_request *)payload)->session_id;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Stop a retired shard once it has no pipes and no sessions left.
+ * Called with wp_keys_lock held.
+ */
+static void wp_shard_maybe_stop(struct wp_shard *shard)
+{
+	if (shard->nr_pipes || shard->nr_sessions || shard->stop_sent ||
+	    g_atomic_int_get(&shard->state) != WP_SHARD_RETIRING)
+		return;
+
+	shard->stop_sent = 1;
+	g_async_queue_push(shard->queue, &wp_shard_stop);
+}
+
+static void wp_pipe_unbind(unsigned int handle, struct wp_shard *shard)
+{
+	g_hash_table_remove(wp_pipes, GUINT_TO_POINTER(handle));
+	shard->nr_pipes--;
+	wp_shard_maybe_stop(shard);
+}
+
+/*
+ * Called by the worker that ran the open of @handle when it failed, or
+ * was never run, before kcifsd gets the answer: it may reuse the handle
+ * right after that.
+ */
+static void wp_pipe_release(unsigned int handle)
+{
+	struct wp_shard *shard;
+
+	g_mutex_lock(&wp_keys_lock);
+	shard = g_hash_table_lookup(wp_pipes, GUINT_TO_POINTER(handle));
+	if (shard == wp_self)
+		wp_pipe_unbind(handle, shard);
+	g_mutex_unlock(&wp_keys_lock);
+}
+
+/* Called by the worker once it is done with a request of session @id */
+static void wp_session_done(guint64 id)
+{
+	struct wp_session *sess;
+
+	g_mutex_lock(&wp_keys_lock);
+	sess = g_hash_table_lookup(wp_sessions, &id);
+	if (sess && !--sess->inflight) {
+		struct wp_shard *shard = sess->shard;
+
+		/* Frees the session */
+		g_hash_table_remove(wp_sessions, &id);
+		shard->nr_sessions--;
+		wp_shard_maybe_stop(shard);
+	}
+	g_mutex_unlock(&wp_keys_lock);
+}
+
+static const char *wp_event_name(int type)
+{
+	switch (type) {
+	case CIFSD_EVENT_HEARTBEAT_REQUEST:
+		return "heartbeat";
+	case CIFSD_EVENT_LOGIN_REQUEST:
+		return "login";
+	case CIFSD_EVENT_SHARE_CONFIG_REQUEST:
+		return "share config";
+	case CIFSD_EVENT_TREE_CONNECT_REQUEST:
+		return "tree connect";
+	case CIFSD_EVENT_TREE_DISCONNECT_REQUEST:
+		return "tree disconnect";
+	case CIFSD_EVENT_LOGOUT_REQUEST:
+		return "logout";
+	case CIFSD_EVENT_RPC_REQUEST:
+		return "rpc";
+	}
+	return "unknown";
+}
+
+/* See wp_request_expired() */
+static int wp_past_deadline(long long received)
+{
+	long long deadline = global_conf.ipc_timeout;
+
+	if (!deadline)
+		deadline = WP_DEFAULT_DEADLINE;
+	return g_get_monotonic_time() - received >= deadline * G_USEC_PER_SEC;
+}
+
+static const char * const wp_class_names[WP_NR_CLASSES] = {
+	[WP_CLASS_AUTH]		= "login/tree connect",
+	[WP_CLASS_SHARE]	= "share config",
+	[WP_CLASS_RPC]		= "rpc",
+};
 
 #define VALID_IPC_MSG(m,t) 					\
 	({							\
@@ -31,13 +336,79 @@ static GThreadPool *pool;
 		ret;						\
 	})
 
+void *wp_arena_alloc(size_t sz)
+{
+	struct wp_arena_chunk *chunk = wp_arena;
+	void *p;
+
+	/* Nobody would ever reset it */
+	if (!wp_self)
+		return NULL;
+
+	sz = (sz + WP_ARENA_ALIGN - 1) & ~((size_t)WP_ARENA_ALIGN - 1);
+	if (!chunk || chunk->sz - chunk->used < sz) {
+		size_t chunk_sz = MAX(WP_ARENA_CHUNK_SZ, sizeof(*chunk) + sz);
+
+		chunk = g_try_malloc(chunk_sz);
+		if (!chunk)
+			return NULL;
+
+		chunk->next = wp_arena;
+		chunk->sz = chunk_sz - sizeof(*chunk);
+		chunk->used = 0;
+		wp_arena = chunk;
+	}
+
+	p = chunk->data + chunk->used;
+	chunk->used += sz;
+	return p;
+}
+
+/* Keep one standard chunk, oversized ones would pin their memory */
+static void wp_arena_reset(void)
+{
+	struct wp_arena_chunk *chunk = wp_arena;
+	struct wp_arena_chunk *keep = NULL;
+
+	while (chunk) {
+		struct wp_arena_chunk *next = chunk->next;
+
+		if (!keep &&
+		    chunk->sz == WP_ARENA_CHUNK_SZ - sizeof(*chunk))
+			keep = chunk;
+		else
+			g_free(chunk);
+		chunk = next;
+	}
+
+	if (keep) {
+		keep->next = NULL;
+		keep->used = 0;
+	}
+	wp_arena = keep;
+}
+
+static void wp_arena_destroy(void)
+{
+	wp_arena_reset();
+	g_free(wp_arena);
+	wp_arena = NULL;
+}
+
+static void wp_set_stage(const char *stage)
+{
+	if (wp_self)
+		g_atomic_pointer_set(&wp_self->stage, (gpointer)stage);
+}
+
 static int login_request(struct cifsd_ipc_msg *msg)
 {
 	struct cifsd_login_request *req;
 	struct cifsd_login_response *resp;
 	struct cifsd_ipc_msg *resp_msg;
 
-	resp_msg = ipc_msg_alloc(sizeof(*resp));
+	resp_msg = ipc_msg_alloc_response(CIFSD_EVENT_LOGIN_RESPONSE,
+					  sizeof(*resp));
 	if (!resp_msg)
 		goto out;
 
@@ -45,15 +416,16 @@ static int login_request(struct cifsd_ipc_msg *msg)
 	resp = CIFSD_IPC_MSG_PAYLOAD(resp_msg);
 
 	resp->status = CIFSD_USER_FLAG_INVALID;
+	wp_set_stage("login");
 	if (VALID_IPC_MSG(msg, struct cifsd_login_request))
 		usm_handle_login_request(req, resp);
 
 	resp_msg->type = CIFSD_EVENT_LOGIN_RESPONSE;
 	resp->handle = req->handle;
 
+	wp_set_stage("send response");
 	ipc_msg_send(resp_msg);
 out:
-	ipc_msg_free(resp_msg);
 	return 0;
 }
 
@@ -63,7 +435,8 @@ static int tree_connect_request(struct cifsd_ipc_msg *msg)
 	struct cifsd_tree_connect_response *resp;
 	struct cifsd_ipc_msg *resp_msg;
 
-	resp_msg = ipc_msg_alloc(sizeof(*resp));
+	resp_msg = ipc_msg_alloc_response(CIFSD_EVENT_TREE_CONNECT_RESPONSE,
+					  sizeof(*resp));
 	if (!resp_msg)
 		goto out;
 
@@ -73,46 +446,290 @@ static int tree_connect_request(struct cifsd_ipc_msg *msg)
 	resp->status = CIFSD_TREE_CONN_STATUS_ERROR;
 	resp->connection_flags = 0;
 
+	wp_set_stage("tree connect");
 	if (VALID_IPC_MSG(msg, struct cifsd_tree_connect_request))
 		tcm_handle_tree_connect(req, resp);
 
 	resp_msg->type = CIFSD_EVENT_TREE_CONNECT_RESPONSE;
 	resp->handle = req->handle;
 
+	wp_set_stage("send response");
 	ipc_msg_send(resp_msg);
 out:
-	ipc_msg_free(resp_msg);
 	return 0;
 }
 
-static int share_config_request(struct cifsd_ipc_msg *msg)
+/*
+ * Share config responses only differ in the handle, and clients tend to
+ * connect to the same share all at once. Requests join a flight keyed
+ * by the share name and the config generation before they even look
+ * the share up. The first one builds the response, the ones that come
+ * while it is at it leave their handle behind and the builder answers
+ * them as well. The finished body is then kept for the rest of the
+ * generation, and later requests only copy it with their own handle.
+ * Anything that changes what a share looks like bumps the generation.
+ */
+struct share_config_waiter {
+	unsigned int	handle;
+	long long	received;
+};
+
+struct share_config_flight {
+	unsigned int		conf_gen;
+	/* Requests waiting for the builder, NULL once it has landed */
+	GArray			*waiters;
+	/* The finished body, NULL while it is being built */
+	struct cifsd_ipc_msg	*body;
+};
+
+enum {
+	SHARE_CONFIG_BUILD = 0,
+	SHARE_CONFIG_WAIT,
+	SHARE_CONFIG_HIT,
+};
+
+static GHashTable *share_config_flights;
+static GMutex share_config_flights_lock;
+/* Generation of the bodies in share_config_flights */
+static unsigned int share_config_gen;
+
+static int share_config_built;
+static int share_config_coalesced;
+static int share_config_hits;
+
+static void free_share_config_flight(gpointer data)
+{
+	struct share_config_flight *flight = data;
+
+	if (flight->waiters)
+		g_array_free(flight->waiters, 1);
+	ipc_msg_free(flight->body);
+	g_free(flight);
+}
+
+static struct cifsd_ipc_msg *share_config_build(struct cifsd_share *share,
+						unsigned int handle)
 {
-	struct cifsd_share_config_request *req;
 	struct cifsd_share_config_response *resp;
-	struct cifsd_share *share = NULL;
 	struct cifsd_ipc_msg *resp_msg;
 	int payload_sz = 0;
 
-	req = CIFSD_IPC_MSG_PAYLOAD(msg);
-	if (VALID_IPC_MSG(msg, struct cifsd_share_config_request)) {
-		share = shm_lookup_share(req->share_name);
-		if (share)
-			payload_sz = shm_share_config_payload_size(share);
-	}
+	if (share)
+		payload_sz = shm_share_config_payload_size(share);
 
-	resp_msg = ipc_msg_alloc(sizeof(*resp) + payload_sz);
+	resp_msg = ipc_msg_alloc_response(CIFSD_EVENT_SHARE_CONFIG_RESPONSE,
+					  sizeof(*resp) + payload_sz);
 	if (!resp_msg)
-		goto out;
+		return NULL;
 
 	resp = CIFSD_IPC_MSG_PAYLOAD(resp_msg);
+	wp_set_stage("share config");
 	shm_handle_share_config_request(share, resp);
 	resp_msg->type = CIFSD_EVENT_SHARE_CONFIG_RESPONSE;
-	resp->handle = req->handle;
+	resp->handle = handle;
+	return resp_msg;
+}
 
-	ipc_msg_send(resp_msg);
+static struct cifsd_ipc_msg *share_config_copy(struct cifsd_ipc_msg *msg,
+					       unsigned int handle)
+{
+	struct cifsd_share_config_response *resp;
+	struct cifsd_ipc_msg *resp_msg;
+
+	resp_msg = ipc_msg_alloc_response(CIFSD_EVENT_SHARE_CONFIG_RESPONSE,
+					  msg->sz);
+	if (!resp_msg)
+		return NULL;
+
+	resp = CIFSD_IPC_MSG_PAYLOAD(resp_msg);
+	memcpy(resp, CIFSD_IPC_MSG_PAYLOAD(msg), msg->sz);
+	resp_msg->type = CIFSD_EVENT_SHARE_CONFIG_RESPONSE;
+	resp->handle = handle;
+	return resp_msg;
+}
+
+/* Kept bodies outlive the worker, so they don't come from its cache */
+static struct cifsd_ipc_msg *share_config_keep(struct cifsd_ipc_msg *msg)
+{
+	struct cifsd_ipc_msg *body;
+
+	body = ipc_msg_alloc(msg->sz);
+	if (!body)
+		return NULL;
+
+	memcpy(CIFSD_IPC_MSG_PAYLOAD(body), CIFSD_IPC_MSG_PAYLOAD(msg),
+	       msg->sz);
+	body->type = msg->type;
+	return body;
+}
+
+static gboolean share_config_flight_stale(gpointer k, gpointer v,
+					  gpointer gen)
+{
+	struct share_config_flight *flight = v;
+
+	/* Flights still being built are removed when they land */
+	return flight->conf_gen != GPOINTER_TO_UINT(gen) && !flight->waiters;
+}
+
+/*
+ * Returns SHARE_CONFIG_HIT with *resp_msg set if the body is ready,
+ * SHARE_CONFIG_WAIT if the request has been left for the builder to
+ * answer. Otherwise the caller builds the response and, if *flight is
+ * set, hands it over to share_config_flight_land().
+ */
+static int share_config_flight_join(struct cifsd_ipc_msg *msg,
+				    unsigned int conf_gen,
+				    struct share_config_flight **flight,
+				    struct cifsd_ipc_msg **resp_msg)
+{
+	struct cifsd_share_config_request *req = CIFSD_IPC_MSG_PAYLOAD(msg);
+	struct share_config_flight *f;
+	int ret = SHARE_CONFIG_BUILD;
+
+	*flight = NULL;
+	g_mutex_lock(&share_config_flights_lock);
+	if (conf_gen != share_config_gen &&
+	    conf_gen == g_atomic_int_get(&global_conf.conf_gen)) {
+		g_hash_table_foreach_remove(share_config_flights,
+					    share_config_flight_stale,
+					    GUINT_TO_POINTER(conf_gen));
+		share_config_gen = conf_gen;
+	}
+
+	f = g_hash_table_lookup(share_config_flights, req->share_name);
+	if (f && f->conf_gen == conf_gen) {
+		if (f->body) {
+			*resp_msg = share_config_copy(f->body, req->handle);
+			g_atomic_int_inc(&share_config_hits);
+			ret = SHARE_CONFIG_HIT;
+		} else {
+			struct share_config_waiter w = {
+				.handle		= req->handle,
+				.received	= msg->received,
+			};
+
+			g_array_append_val(f->waiters, w);
+			g_atomic_int_inc(&share_config_coalesced);
+			ret = SHARE_CONFIG_WAIT;
+		}
+		goto out;
+	}
+
+	/* A flight of another generation is in the air, build on the side */
+	if (f || conf_gen != share_config_gen)
+		goto out;
+
+	f = g_new0(struct share_config_flight, 1);
+	f->conf_gen = conf_gen;
+	f->waiters = g_array_new(0, 0, sizeof(struct share_config_waiter));
+	g_hash_table_insert(share_config_flights,
+			    g_strdup(req->share_name),
+			    f);
+	*flight = f;
+out:
+	g_mutex_unlock(&share_config_flights_lock);
+	return ret;
+}
+
+/*
+ * Answer the waiters with a copy of @resp_msg, and keep the body for
+ * later requests if the share exists. If the config has been reloaded
+ * while it was built, or there is no body at all, the response is
+ * built once more for the waiters. When even that fails, they are left
+ * for kcifsd to time out, as their own requests would be.
+ */
+static void share_config_flight_land(struct share_config_flight *flight,
+				     char *name,
+				     struct cifsd_share *share,
+				     struct cifsd_ipc_msg *resp_msg)
+{
+	struct cifsd_ipc_msg *body = resp_msg;
+	GArray *waiters;
+	int i;
+
+	wp_set_stage("share config waiters");
+	g_mutex_lock(&share_config_flights_lock);
+	waiters = flight->waiters;
+	flight->waiters = NULL;
+	if (flight->conf_gen != g_atomic_int_get(&global_conf.conf_gen))
+		body = NULL;
+	if (body && share)
+		flight->body = share_config_keep(body);
+	/* Names that match no share are not worth keeping */
+	if (!flight->body)
+		g_hash_table_remove(share_config_flights, name);
+	g_mutex_unlock(&share_config_flights_lock);
+
+	if (!waiters->len)
+		goto out;
+
+	if (!body) {
+		share = shm_lookup_share(name);
+		body = share_config_build(share, 0);
+		put_cifsd_share(share);
+		if (!body)
+			goto out;
+	}
+
+	for (i = 0; i < waiters->len; i++) {
+		struct share_config_waiter *w;
+		struct cifsd_ipc_msg *msg;
+
+		w = &g_array_index(waiters, struct share_config_waiter, i);
+		if (wp_past_deadline(w->received)) {
+			g_atomic_int_inc(&wp_expired_events[
+					CIFSD_EVENT_SHARE_CONFIG_REQUEST]);
+			continue;
+		}
+
+		msg = share_config_copy(body, w->handle);
+		if (msg)
+			ipc_msg_send(msg);
+	}
+
+	if (body != resp_msg)
+		ipc_msg_free(body);
 out:
+	g_array_free(waiters, 1);
+}
+
+static int share_config_request(struct cifsd_ipc_msg *msg)
+{
+	struct cifsd_share_config_request *req;
+	struct share_config_flight *flight = NULL;
+	struct cifsd_share *share = NULL;
+	struct cifsd_ipc_msg *resp_msg = NULL;
+
+	req = CIFSD_IPC_MSG_PAYLOAD(msg);
+	if (VALID_IPC_MSG(msg, struct cifsd_share_config_request)) {
+		/* Read the generation before the share, not after */
+		unsigned int conf_gen = g_atomic_int_get(&global_conf.conf_gen);
+
+		switch (share_config_flight_join(msg, conf_gen,
+						 &flight, &resp_msg)) {
+		case SHARE_CONFIG_WAIT:
+			return 0;
+		case SHARE_CONFIG_HIT:
+			goto send;
+		}
+
+		wp_set_stage("share lookup");
+		share = shm_lookup_share(req->share_name);
+	}
+
+	resp_msg = share_config_build(share, req->handle);
+	if (flight) {
+		share_config_flight_land(flight, req->share_name,
+					 share, resp_msg);
+		g_atomic_int_inc(&share_config_built);
+	}
 	put_cifsd_share(share);
-	ipc_msg_free(resp_msg);
+send:
+	if (resp_msg) {
+		wp_set_stage("send response");
+		ipc_msg_send(resp_msg);
+	}
 	return 0;
 }
 
@@ -155,10 +772,12 @@ static int rpc_request(struct cifsd_ipc_msg *msg)
 
 	req = CIFSD_IPC_MSG_PAYLOAD(msg);
 	if (req->flags & CIFSD_RPC_METHOD_RETURN)
-		resp_msg = ipc_msg_alloc(CIFSD_IPC_MAX_MESSAGE_SIZE -
+		resp_msg = ipc_msg_alloc_response(CIFSD_EVENT_RPC_RESPONSE,
+				ipc_msg_max_size() -
 				sizeof(struct cifsd_rpc_command));
 	else
-		resp_msg = ipc_msg_alloc(sizeof(struct cifsd_rpc_command));
+		resp_msg = ipc_msg_alloc_response(CIFSD_EVENT_RPC_RESPONSE,
+				sizeof(struct cifsd_rpc_command));
 	if (!resp_msg)
 		goto out;
 
@@ -168,14 +787,22 @@ static int rpc_request(struct cifsd_ipc_msg *msg)
 		pr_err("RAP command is not supported yet %x\n", req->flags);
 		ret = CIFSD_RPC_ENOTIMPLEMENTED;
 	} else if (req->flags & CIFSD_RPC_OPEN_METHOD) {
+		wp_set_stage("rpc open");
 		ret = rpc_open_request(req, resp);
+		/* A collision leaves the pipe that is there already alone */
+		if (ret != CIFSD_RPC_OK && ret != -EEXIST)
+			wp_pipe_release(req->handle);
 	} else if (req->flags & CIFSD_RPC_CLOSE_METHOD) {
+		wp_set_stage("rpc close");
 		ret = rpc_close_request(req, resp);
 	} else if (req->flags & CIFSD_RPC_IOCTL_METHOD) {
+		wp_set_stage("rpc ioctl");
 		ret = rpc_ioctl_request(req, resp, resp_msg->sz);
 	} else if (req->flags & CIFSD_RPC_WRITE_METHOD) {
+		wp_set_stage("rpc write");
 		ret = rpc_write_request(req, resp);
 	} else if (req->flags & CIFSD_RPC_READ_METHOD) {
+		wp_set_stage("rpc read");
 		ret = rpc_read_request(req, resp, resp_msg->sz);
 	} else {
 		pr_err("Unknown RPC method: %x\n", req->flags);
@@ -187,15 +814,66 @@ static int rpc_request(struct cifsd_ipc_msg *msg)
 	resp->flags = ret;
 	resp_msg->sz = sizeof(struct cifsd_rpc_command) + resp->payload_sz;
 
+	wp_set_stage("send response");
 	ipc_msg_send(resp_msg);
 out:
-	ipc_msg_free(resp_msg);
 	return 0;
 }
 
-static void worker_pool_fn(gpointer event, gpointer user_data)
+/*
+ * kcifsd stops waiting for a response after `ipc timeout' and drops it
+ * when it finally comes, so there is no point in working on requests
+ * that have been queued for longer than that: skip them and let the
+ * workers catch up with the ones that can still be answered.
+ *
+ * RPC close and tree disconnect are always handled, they release the
+ * pipe or the tree no matter whether anybody waits for the answer.
+ */
+static int wp_request_expired(struct cifsd_ipc_msg *msg)
+{
+	if (!wp_past_deadline(msg->received))
+		return 0;
+
+	if (msg->type == CIFSD_EVENT_TREE_DISCONNECT_REQUEST)
+		return 0;
+
+	if (msg->type == CIFSD_EVENT_RPC_REQUEST) {
+		struct cifsd_rpc_command *req = CIFSD_IPC_MSG_PAYLOAD(msg);
+
+		if (req->flags & CIFSD_RPC_CLOSE_METHOD)
+			return 0;
+	}
+
+	if (msg->type < CIFSD_EVENT_MAX)
+		g_atomic_int_inc(&wp_expired_events[msg->type]);
+	return 1;
+}
+
+static void wp_account_mallocs(unsigned int type, unsigned long nr)
+{
+	if (type >= CIFSD_EVENT_MAX || !wp_self)
+		return;
+
+	g_mutex_lock(&wp_self->malloc_lock);
+	wp_self->malloc_calls[type] += nr;
+	wp_self->malloc_requests[type]++;
+	g_mutex_unlock(&wp_self->malloc_lock);
+}
+
+static void worker_pool_fn(struct cifsd_ipc_msg *msg)
 {
-	struct cifsd_ipc_msg *msg = (struct cifsd_ipc_msg *)event;
+	unsigned long mallocs = malloc_stats_calls();
+	unsigned int type = msg->type;
+	guint64 session_id;
+
+	if (wp_request_expired(msg)) {
+		struct cifsd_rpc_command *req = CIFSD_IPC_MSG_PAYLOAD(msg);
+
+		if (type == CIFSD_EVENT_RPC_REQUEST &&
+		    req->flags & CIFSD_RPC_OPEN_METHOD)
+			wp_pipe_release(req->handle);
+		goto out;
+	}
 
 	switch (msg->type) {
 	case CIFSD_EVENT_LOGIN_REQUEST:
@@ -210,10 +888,6 @@ static void worker_pool_fn(gpointer event, gpointer user_data)
 		tree_disconnect_request(msg);
 		break;
 
-	case CIFSD_EVENT_LOGOUT_REQUEST:
-		logout_request(msg);
-		break;
-
 	case CIFSD_EVENT_SHARE_CONFIG_REQUEST:
 		share_config_request(msg);
 		break;
@@ -222,48 +896,890 @@ static void worker_pool_fn(gpointer event, gpointer user_data)
 		rpc_request(msg);
 		break;
 
+	default:
+		pr_err("Unknown IPC message type: %d\n", msg->type);
+		break;
+	}
+out:
+	wp_set_stage("cleanup");
+	if (wp_session_id(msg, &session_id))
+		wp_session_done(session_id);
+	ipc_msg_free(msg);
+	wp_arena_reset();
+	wp_account_mallocs(type, malloc_stats_calls() - mallocs);
+}
+
+/*
+ * Events that need no response and take no lock at all are handled
+ * right on the IPC receive thread: handing them over to the pool costs
+ * more than the work itself. Tree disconnects go to the pool, behind
+ * the other requests of their session.
+ *
+ * They are put aside while a receive burst is being queued and run by
+ * wp_run_inline() once the whole burst is with the workers, so waiting
+ * on a management table lock never delays the requests behind them.
+ * Only the IPC receive thread touches the list.
+ */
+static struct cifsd_ipc_msg *wp_inline_head;
+static struct cifsd_ipc_msg **wp_inline_tail = &wp_inline_head;
+
+static int wp_defer_inline(struct cifsd_ipc_msg *msg)
+{
+	switch (msg->type) {
+	case CIFSD_EVENT_LOGOUT_REQUEST:
 	case CIFSD_EVENT_HEARTBEAT_REQUEST:
-		heartbeat_request(msg);
 		break;
 
 	default:
-		pr_err("Unknown IPC message type: %d\n", msg->type);
+		return 0;
+	}
+
+	msg->next = NULL;
+	*wp_inline_tail = msg;
+	wp_inline_tail = &msg->next;
+	return 1;
+}
+
+static void wp_handle_inline(struct cifsd_ipc_msg *msg)
+{
+	switch (msg->type) {
+	case CIFSD_EVENT_LOGOUT_REQUEST:
+		logout_request(msg);
+		break;
+
+	case CIFSD_EVENT_HEARTBEAT_REQUEST:
+		heartbeat_request(msg);
+		break;
+	}
+
+	ipc_msg_free(msg);
+	g_atomic_int_inc(&wp_inline_events);
+}
+
+void wp_run_inline(void)
+{
+	struct cifsd_ipc_msg *msg;
+
+	while (wp_inline_head) {
+		msg = wp_inline_head;
+		wp_inline_head = msg->next;
+		wp_handle_inline(msg);
+	}
+	wp_inline_tail = &wp_inline_head;
+}
+
+static int wp_event_class(struct cifsd_ipc_msg *msg)
+{
+	switch (msg->type) {
+	case CIFSD_EVENT_LOGIN_REQUEST:
+	case CIFSD_EVENT_TREE_CONNECT_REQUEST:
+	/* Same lane as the tree connects, they must not overtake them */
+	case CIFSD_EVENT_TREE_DISCONNECT_REQUEST:
+		return WP_CLASS_AUTH;
+
+	case CIFSD_EVENT_SHARE_CONFIG_REQUEST:
+		return WP_CLASS_SHARE;
+	}
+	return WP_CLASS_RPC;
+}
+
+/* Only called by the IPC receive thread */
+static int wp_deque_push(struct wp_deque *dq, void *msg)
+{
+	int b = g_atomic_int_get(&dq->bottom);
+	int t = g_atomic_int_get(&dq->top);
+
+	if ((unsigned int)(b - t) >= WP_DEQUE_SZ)
+		return -ENOSPC;
+
+	dq->slots[b & WP_DEQUE_MASK] = msg;
+	/* Full barrier: the slot is visible before the new bottom */
+	g_atomic_int_set(&dq->bottom, b + 1);
+	return 0;
+}
+
+static void *wp_deque_steal(struct wp_deque *dq)
+{
+	void *msg;
+	int t, b;
+
+	do {
+		t = g_atomic_int_get(&dq->top);
+		b = g_atomic_int_get(&dq->bottom);
+		if ((int)(b - t) <= 0)
+			return NULL;
+
+		msg = dq->slots[t & WP_DEQUE_MASK];
+	} while (!g_atomic_int_compare_and_exchange(&dq->top, t, t + 1));
+	return msg;
+}
+
+static int wp_deque_length(struct wp_deque *dq)
+{
+	int len = g_atomic_int_get(&dq->bottom) - g_atomic_int_get(&dq->top);
+
+	return len > 0 ? len : 0;
+}
+
+static void *wp_steal(struct wp_shard *shard, int class)
+{
+	int nr = g_atomic_int_get(&nr_shards);
+	void *msg;
+	int i;
+
+	/* A retired shard is past nr, nobody else looks at its deques */
+	msg = wp_deque_steal(&shard->deques[class]);
+	if (msg)
+		return msg;
+
+	for (i = 1; i <= nr; i++) {
+		struct wp_shard *victim = shards[(shard->id + i) % nr];
+
+		if (victim == shard)
+			continue;
+
+		msg = wp_deque_steal(&victim->deques[class]);
+		if (msg) {
+			g_atomic_int_inc(&wp_stolen_events);
+			return msg;
+		}
+	}
+	return NULL;
+}
+
+static void *wp_lane_pop(struct wp_shard *shard, int class)
+{
+	void *msg;
+
+	msg = g_async_queue_try_pop(shard->lanes[class]);
+	if (!msg)
+		msg = wp_steal(shard, class);
+	return msg;
+}
+
+static int wp_shard_wake(struct wp_shard *shard)
+{
+	if (!g_atomic_int_compare_and_exchange(&shard->idle, 1, 0))
+		return 0;
+	g_async_queue_push(shard->queue, &wp_shard_kick);
+	return 1;
+}
+
+/* An idle shard if there is one, the next one in turn otherwise */
+static struct wp_shard *wp_pick_shard(void)
+{
+	struct wp_shard *shard = NULL;
+	int i;
+
+	for (i = 0; i < nr_shards; i++) {
+		struct wp_shard *s = shards[(wp_next_shard + i) % nr_shards];
+
+		if (g_atomic_int_get(&s->idle)) {
+			shard = s;
+			break;
+		}
+	}
+	wp_next_shard = (wp_next_shard + 1) % nr_shards;
+	if (!shard)
+		shard = shards[wp_next_shard];
+	return shard;
+}
+
+/*
+ * Pipes are bound when they are opened. Requests for a handle that was
+ * never opened go anywhere, the RPC code answers them with an error.
+ */
+static struct wp_shard *wp_pipe_shard(struct cifsd_rpc_command *req)
+{
+	struct wp_shard *shard;
+	int i;
+
+	shard = g_hash_table_lookup(wp_pipes, GUINT_TO_POINTER(req->handle));
+	if (shard || !(req->flags & CIFSD_RPC_OPEN_METHOD))
+		return shard;
+
+	shard = shards[0];
+	for (i = 1; i < nr_shards; i++) {
+		if (shards[i]->nr_pipes < shard->nr_pipes)
+			shard = shards[i];
+	}
+
+	g_hash_table_insert(wp_pipes, GUINT_TO_POINTER(req->handle), shard);
+	shard->nr_pipes++;
+	return shard;
+}
+
+static struct wp_shard *wp_session_shard(guint64 id)
+{
+	struct wp_session *sess;
+
+	sess = g_hash_table_lookup(wp_sessions, &id);
+	if (!sess) {
+		sess = g_new0(struct wp_session, 1);
+		sess->id = id;
+		sess->shard = wp_pick_shard();
+		sess->shard->nr_sessions++;
+		g_hash_table_insert(wp_sessions, &sess->id, sess);
+	}
+	sess->inflight++;
+	return sess->shard;
+}
+
+/*
+ * The shard that must run @msg, NULL if any shard may. Called by the
+ * IPC receive thread, with wp_keys_lock held.
+ */
+static struct wp_shard *wp_affine_shard(struct cifsd_ipc_msg *msg)
+{
+	guint64 id;
+
+	if (msg->type == CIFSD_EVENT_RPC_REQUEST)
+		return wp_pipe_shard(CIFSD_IPC_MSG_PAYLOAD(msg));
+	if (wp_session_id(msg, &id))
+		return wp_session_shard(id);
+	return NULL;
+}
+
+static int wp_queue_affine(struct cifsd_ipc_msg *msg,
+			   int class,
+			   struct wp_shard *shard)
+{
+	struct cifsd_rpc_command *req = CIFSD_IPC_MSG_PAYLOAD(msg);
+	int depth;
+
+	g_async_queue_push(shard->lanes[class], msg);
+	wp_shard_wake(shard);
+	depth = g_async_queue_length(shard->lanes[class]);
+
+	/* Nothing follows a close, the next pipe may go elsewhere */
+	if (msg->type == CIFSD_EVENT_RPC_REQUEST &&
+	    req->flags & CIFSD_RPC_CLOSE_METHOD)
+		wp_pipe_unbind(req->handle, shard);
+	return depth;
+}
+
+static int wp_queue_stealable(struct cifsd_ipc_msg *msg, int class)
+{
+	struct wp_shard *shard = wp_pick_shard();
+	int i;
+
+	if (wp_deque_push(&shard->deques[class], msg)) {
+		g_async_queue_push(shard->lanes[class], msg);
+		wp_shard_wake(shard);
+		return g_async_queue_length(shard->lanes[class]);
+	}
+
+	/*
+	 * The shard is busy. A peer that went idle after the scan above
+	 * may have made its last steal attempt before the push and
+	 * missed the request, but its idle flag is already up: wake it.
+	 */
+	if (!wp_shard_wake(shard)) {
+		for (i = 0; i < nr_shards; i++) {
+			if (wp_shard_wake(shards[i]))
+				break;
+		}
+	}
+	return wp_deque_length(&shard->deques[class]);
+}
+
+/*
+ * Answer a request right away with an error, without queueing it.
+ * Returns 0 for requests that must be handled regardless.
+ */
+static int wp_reject(struct cifsd_ipc_msg *msg)
+{
+	void *req = CIFSD_IPC_MSG_PAYLOAD(msg);
+	struct cifsd_ipc_msg *resp_msg;
+
+	switch (msg->type) {
+	case CIFSD_EVENT_LOGIN_REQUEST: {
+		struct cifsd_login_response *resp;
+
+		resp_msg = ipc_msg_alloc_response(CIFSD_EVENT_LOGIN_RESPONSE,
+						  sizeof(*resp));
+		if (!resp_msg)
+			break;
+		resp = CIFSD_IPC_MSG_PAYLOAD(resp_msg);
+		resp->status = CIFSD_USER_FLAG_INVALID;
+		resp->handle = ((struct cifsd_login_request *)req)->handle;
+		ipc_msg_send(resp_msg);
 		break;
 	}
+	case CIFSD_EVENT_TREE_CONNECT_REQUEST: {
+		struct cifsd_tree_connect_response *resp;
 
+		resp_msg = ipc_msg_alloc_response(
+					CIFSD_EVENT_TREE_CONNECT_RESPONSE,
+					sizeof(*resp));
+		if (!resp_msg)
+			break;
+		resp = CIFSD_IPC_MSG_PAYLOAD(resp_msg);
+		resp->status = CIFSD_TREE_CONN_STATUS_ERROR;
+		resp->handle =
+			((struct cifsd_tree_connect_request *)req)->handle;
+		ipc_msg_send(resp_msg);
+		break;
+	}
+	case CIFSD_EVENT_SHARE_CONFIG_REQUEST: {
+		struct cifsd_share_config_response *resp;
+
+		resp_msg = ipc_msg_alloc_response(
+					CIFSD_EVENT_SHARE_CONFIG_RESPONSE,
+					sizeof(*resp));
+		if (!resp_msg)
+			break;
+		resp = CIFSD_IPC_MSG_PAYLOAD(resp_msg);
+		resp->flags = CIFSD_SHARE_FLAG_INVALID;
+		resp->handle =
+			((struct cifsd_share_config_request *)req)->handle;
+		ipc_msg_send(resp_msg);
+		break;
+	}
+	case CIFSD_EVENT_RPC_REQUEST: {
+		struct cifsd_rpc_command *resp;
+
+		/* Pipes must be released no matter what */
+		if (((struct cifsd_rpc_command *)req)->flags &
+				CIFSD_RPC_CLOSE_METHOD)
+			return 0;
+
+		resp_msg = ipc_msg_alloc_response(CIFSD_EVENT_RPC_RESPONSE,
+						  sizeof(*resp));
+		if (!resp_msg)
+			break;
+		resp = CIFSD_IPC_MSG_PAYLOAD(resp_msg);
+		resp->handle = ((struct cifsd_rpc_command *)req)->handle;
+		resp->flags = CIFSD_RPC_ENOMEM;
+		resp->payload_sz = 0;
+		ipc_msg_send(resp_msg);
+		break;
+	}
+	default:
+		return 0;
+	}
+
+	g_atomic_int_inc(&wp_rejected_events[msg->type]);
 	ipc_msg_free(msg);
+	return 1;
+}
+
+static int wp_queue_full(int class)
+{
+	int queued = g_atomic_int_get(&wp_queued[class]);
+
+	if (wp_saturated[class] && queued <= global_conf.worker_queue_low) {
+		pr_debug("Worker queue [%s] drained, accepting requests again\n",
+			 wp_class_names[class]);
+		wp_saturated[class] = 0;
+	} else if (!wp_saturated[class] &&
+		   queued >= global_conf.worker_queue_high) {
+		wp_saturations[class]++;
+		if (wp_saturations[class] == 1 ||
+		    !(wp_saturations[class] % 100))
+			pr_err("Worker queue [%s] is full, rejecting requests (%u times so far)\n",
+				wp_class_names[class], wp_saturations[class]);
+		wp_saturated[class] = 1;
+	}
+	return wp_saturated[class];
 }
 
 int wp_ipc_msg_push(struct cifsd_ipc_msg *msg)
 {
-	return g_thread_pool_push(pool, msg, NULL);
+	struct wp_shard *shard;
+	unsigned int depth;
+	int class;
+
+	if (wp_defer_inline(msg))
+		return 0;
+
+	/* The pool is being torn down */
+	if (!nr_shards) {
+		ipc_msg_free(msg);
+		return -EINVAL;
+	}
+
+	class = wp_event_class(msg);
+	if (wp_queue_full(class) && wp_reject(msg))
+		return 0;
+
+	g_atomic_int_inc(&wp_pooled_events);
+	g_atomic_int_inc(&wp_queued[class]);
+	g_mutex_lock(&wp_keys_lock);
+	shard = wp_affine_shard(msg);
+	if (shard)
+		depth = wp_queue_affine(msg, class, shard);
+	g_mutex_unlock(&wp_keys_lock);
+	if (!shard)
+		depth = wp_queue_stealable(msg, class);
+
+	if (depth > wp_max_queue_depth)
+		wp_max_queue_depth = depth;
+	return 0;
 }
 
-void wp_destroy(void)
+static unsigned int wp_queue_depth(void)
 {
-	if (pool)
-		g_thread_pool_free(pool, 1, 1);
+	unsigned int depth = 0;
+	int i, c;
+
+	/* Retired shards may still have pipes to finish */
+	for (i = 0; i < CIFSD_CONF_MAX_WORKER_THREADS && shards[i]; i++) {
+		for (c = 0; c < WP_NR_CLASSES; c++) {
+			int len = g_async_queue_length(shards[i]->lanes[c]);
+
+			if (len > 0)
+				depth += len;
+			depth += wp_deque_length(&shards[i]->deques[c]);
+		}
+	}
+	return depth;
 }
 
-int wp_init(void)
+static void wp_account_queue_wait(struct cifsd_ipc_msg *msg)
+{
+	long long wait = g_get_monotonic_time() - msg->received;
+	int bucket = 0;
+
+	while (bucket < WP_WAIT_BUCKETS - 1 && wait >= (1LL << bucket))
+		bucket++;
+	g_atomic_int_inc(&wp_queue_wait[wp_event_class(msg)][bucket]);
+}
+
+void wp_dump_stats(void)
+{
+	int c, i;
+
+	pr_info("Worker events handled inline: %d, queued to the pool: %d, stolen: %d\n",
+		g_atomic_int_get(&wp_inline_events),
+		g_atomic_int_get(&wp_pooled_events),
+		g_atomic_int_get(&wp_stolen_events));
+
+	pr_info("Worker threads: %d, queue depth: %u, max: %u\n",
+		nr_shards,
+		wp_queue_depth(),
+		wp_max_queue_depth);
+
+	for (c = 0; c < WP_NR_CLASSES; c++) {
+		pr_info("Worker queue wait [%s]:\n", wp_class_names[c]);
+		for (i = 0; i < WP_WAIT_BUCKETS; i++) {
+			int nr = g_atomic_int_get(&wp_queue_wait[c][i]);
+
+			if (nr)
+				pr_info("\t< %lld usec: %d\n", 1LL << i, nr);
+		}
+	}
+
+	for (i = 0; i < CIFSD_EVENT_MAX; i++) {
+		int nr = g_atomic_int_get(&wp_expired_events[i]);
+
+		if (nr)
+			pr_info("Worker requests expired [%s]: %d\n",
+				wp_event_name(i), nr);
+	}
+
+	pr_info("Share config responses built: %d, coalesced: %d, copied: %d\n",
+		g_atomic_int_get(&share_config_built),
+		g_atomic_int_get(&share_config_coalesced),
+		g_atomic_int_get(&share_config_hits));
+
+	for (i = 0; i < CIFSD_EVENT_MAX; i++) {
+		long long calls = 0, requests = 0;
+		int s;
+
+		/* Retired shards keep their counts until wp_destroy() */
+		for (s = 0; s < CIFSD_CONF_MAX_WORKER_THREADS && shards[s]; s++) {
+			g_mutex_lock(&shards[s]->malloc_lock);
+			calls += shards[s]->malloc_calls[i];
+			requests += shards[s]->malloc_requests[i];
+			g_mutex_unlock(&shards[s]->malloc_lock);
+		}
+
+		if (calls)
+			pr_info("Worker malloc calls [%s]: %lld in %lld requests\n",
+				wp_event_name(i), calls, requests);
+	}
+
+	for (i = 0; i < CIFSD_EVENT_MAX; i++) {
+		int nr = g_atomic_int_get(&wp_stalls[i]);
+
+		if (nr)
+			pr_info("Worker stalls [%s]: %d\n",
+				wp_event_name(i), nr);
+	}
+	pr_info("Longest worker request seen by the watchdog: %lld ms\n",
+		wp_max_stall);
+
+	for (i = 0; i < WP_NR_CLASSES; i++)
+		pr_info("Worker queue [%s] saturated %u times\n",
+			wp_class_names[i], wp_saturations[i]);
+	for (i = 0; i < CIFSD_EVENT_MAX; i++) {
+		int nr = g_atomic_int_get(&wp_rejected_events[i]);
+
+		if (nr)
+			pr_info("Worker requests rejected [%s]: %d\n",
+				wp_event_name(i), nr);
+	}
+}
+
+/*
+ * Pick the next request: highest class first, unless a lower class
+ * has been passed over too many times.
+ */
+/* Work of the class waits on the shard itself */
+static int wp_class_pending(struct wp_shard *shard, int class)
+{
+	return g_async_queue_length(shard->lanes[class]) > 0 ||
+		wp_deque_length(&shard->deques[class]) > 0;
+}
+
+static void *wp_next_event(struct wp_shard *shard)
+{
+	void *msg = NULL;
+	int c, served;
+
+	for (c = WP_NR_CLASSES - 1; c > 0; c--) {
+		if (shard->passed[c] < WP_CLASS_MAX_PASSED)
+			continue;
+		msg = wp_lane_pop(shard, c);
+		if (msg) {
+			shard->passed[c] = 0;
+			return msg;
+		}
+	}
+
+	for (served = 0; served < WP_NR_CLASSES; served++) {
+		msg = wp_lane_pop(shard, served);
+		if (msg)
+			break;
+	}
+	if (!msg)
+		return NULL;
+
+	shard->passed[served] = 0;
+	/* Only classes that had work waiting were passed over */
+	for (c = served + 1; c < WP_NR_CLASSES; c++) {
+		if (wp_class_pending(shard, c))
+			shard->passed[c]++;
+	}
+	return msg;
+}
+
+static void wp_run_event(struct cifsd_ipc_msg *msg)
+{
+	g_atomic_int_add(&wp_queued[wp_event_class(msg)], -1);
+	wp_account_queue_wait(msg);
+
+	g_atomic_int_set(&wp_self->event_type, msg->type);
+	wp_set_stage("dispatch");
+	g_atomic_int_inc(&wp_self->progress);
+	worker_pool_fn(msg);
+	g_atomic_int_inc(&wp_self->progress);
+}
+
+/* Run whatever is still queued on the shard itself */
+static void wp_shard_drain(struct wp_shard *shard)
+{
+	void *event;
+	int c, busy = 1;
+
+	while (busy) {
+		busy = 0;
+		for (c = 0; c < WP_NR_CLASSES; c++) {
+			event = g_async_queue_try_pop(shard->lanes[c]);
+			if (!event)
+				event = wp_deque_steal(&shard->deques[c]);
+			if (event) {
+				wp_run_event(event);
+				busy = 1;
+			}
+		}
+	}
+}
+
+/*
+ * The idle flag is raised before the last look at the lanes and the
+ * peers' deques, so a request pushed after that look finds the flag
+ * and wakes us up.
+ */
+static gpointer wp_shard_fn(gpointer data)
+{
+	struct wp_shard *shard = data;
+	void *event;
+
+	wp_self = shard;
+	while (1) {
+		event = wp_next_event(shard);
+		if (!event) {
+			g_atomic_int_set(&shard->idle, 1);
+			event = wp_next_event(shard);
+			if (!event)
+				event = g_async_queue_pop(shard->queue);
+			g_atomic_int_set(&shard->idle, 0);
+		}
+
+		if (event == &wp_shard_kick)
+			continue;
+		if (event == &wp_shard_stop) {
+			/* Nobody pushes to us any more */
+			wp_shard_drain(shard);
+			if (g_atomic_int_compare_and_exchange(&shard->state,
+							      WP_SHARD_RETIRING,
+							      WP_SHARD_EXITED))
+				break;
+			/* Taken back into service meanwhile */
+			continue;
+		}
+		wp_run_event(event);
+	}
+
+	wp_arena_destroy();
+	return NULL;
+}
+
+/*
+ * The watchdog period, in milliseconds, 0 if it is disabled. Half the
+ * threshold, so a stall is reported at most 1.5 thresholds late
+ * without waking an idle daemon up more often than it has to.
+ */
+int wp_watchdog_interval(void)
 {
-	GError *err;
+	int threshold = global_conf.worker_stall_ms;
 
-	pool = g_thread_pool_new(worker_pool_fn,
-				 NULL,
-				 MAX_WORKER_THREADS,
-				 0,
-				 &err);
-	if (!pool) {
+	if (!threshold)
+		return 0;
+	return MAX(threshold / 2, WP_WATCHDOG_MIN_INTERVAL);
+}
+
+/*
+ * Called every wp_watchdog_interval() from the main loop. A worker
+ * whose heartbeat has not moved for `worker stall threshold' while it
+ * was handling a request is reported once per request, and once more
+ * when it gets going again. The stall time is measured from the first time the
+ * watchdog saw the heartbeat at that value, so it is a lower bound.
+ */
+void wp_watchdog(void)
+{
+	long long threshold = global_conf.worker_stall_ms;
+	long long now = g_get_monotonic_time();
+	int i;
+
+	if (!threshold)
+		return;
+	threshold *= G_TIME_SPAN_MILLISECOND;
+
+	for (i = 0; i < CIFSD_CONF_MAX_WORKER_THREADS && shards[i]; i++) {
+		struct wp_shard *shard = shards[i];
+		int progress = g_atomic_int_get(&shard->progress);
+		long long stall;
+		int type;
+
+		if (progress != shard->seen_progress) {
+			if (shard->stalled)
+				pr_info("Worker %d recovered after %lld ms\n",
+					i, (now - shard->seen_since) /
+						G_TIME_SPAN_MILLISECOND);
+			shard->seen_progress = progress;
+			shard->seen_since = now;
+			shard->stalled = 0;
+			continue;
+		}
+
+		/* Idle, waiting for requests */
+		if (!(progress & 1))
+			continue;
+
+		stall = now - shard->seen_since;
+		if (stall / G_TIME_SPAN_MILLISECOND > wp_max_stall)
+			wp_max_stall = stall / G_TIME_SPAN_MILLISECOND;
+		if (stall < threshold || shard->stalled)
+			continue;
+
+		shard->stalled = 1;
+		type = g_atomic_int_get(&shard->event_type);
+		if (type < CIFSD_EVENT_MAX)
+			g_atomic_int_inc(&wp_stalls[type]);
+		pr_err("Worker %d stalled for %lld ms: %s request, stage %s\n",
+			i, stall / G_TIME_SPAN_MILLISECOND, wp_event_name(type),
+			(const char *)g_atomic_pointer_get(&shard->stage));
+	}
+}
+
+/*
+ * Workers mostly sleep in NSS lookups and other blocking calls rather
+ * than burn CPU, so "auto" never goes below CIFSD_CONF_MIN_WORKER_THREADS
+ * even on small boxes.
+ */
+static int wp_nr_threads(void)
+{
+	long nr = global_conf.worker_threads;
+
+	if (nr != CIFSD_CONF_WORKER_THREADS_AUTO)
+		return nr;
+
+	nr = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr < CIFSD_CONF_MIN_WORKER_THREADS)
+		nr = CIFSD_CONF_MIN_WORKER_THREADS;
+	if (nr > CIFSD_CONF_MAX_WORKER_THREADS)
+		nr = CIFSD_CONF_MAX_WORKER_THREADS;
+	return nr;
+}
+
+static int wp_shard_start(int id)
+{
+	struct wp_shard *shard = shards[id];
+	GError *err = NULL;
+	char name[16];
+	int c;
+
+	if (shard) {
+		g_mutex_lock(&wp_keys_lock);
+		if (g_atomic_int_compare_and_exchange(&shard->state,
+						      WP_SHARD_RETIRING,
+						      WP_SHARD_RUNNING)) {
+			shard->stop_sent = 0;
+			g_mutex_unlock(&wp_keys_lock);
+			return 0;
+		}
+		g_mutex_unlock(&wp_keys_lock);
+		/* The thread is gone or on its way out, nothing to wait for */
+		if (shard->thread)
+			g_thread_join(shard->thread);
+		shard->thread = NULL;
+	} else {
+		shard = g_new0(struct wp_shard, 1);
+		shard->id = id;
+		g_mutex_init(&shard->malloc_lock);
+		shard->queue = g_async_queue_new();
+		for (c = 0; c < WP_NR_CLASSES; c++)
+			shard->lanes[c] = g_async_queue_new();
+		shards[id] = shard;
+	}
+
+	shard->state = WP_SHARD_RUNNING;
+	shard->stop_sent = 0;
+
+	snprintf(name, sizeof(name), "cifsd-wp/%d", id);
+	shard->thread = g_thread_try_new(name, wp_shard_fn, shard, &err);
+	if (!shard->thread) {
 		if (err) {
-			pr_err("Can't create pool: %s\n", err->message);
+			pr_err("Can't create worker: %s\n", err->message);
 			g_error_free(err);
 		}
-		goto out_error;
+		shard->state = WP_SHARD_EXITED;
+		return -ENOMEM;
 	}
+	return 0;
+}
 
+/*
+ * A retired shard takes no new pipes, sessions or stealable requests.
+ * Its thread keeps serving the pipes and sessions it already has, and
+ * exits once the last of them is gone and its queues are empty. It is joined when
+ * the slot is needed again, or by wp_destroy().
+ */
+static void wp_shard_retire(struct wp_shard *shard)
+{
+	g_mutex_lock(&wp_keys_lock);
+	g_atomic_int_set(&shard->state, WP_SHARD_RETIRING);
+	wp_shard_maybe_stop(shard);
+	g_mutex_unlock(&wp_keys_lock);
+}
+
+/*
+ * Apply the `worker threads` setting, in place, the way
+ * g_thread_pool_set_max_threads() would: new shards are started, or
+ * the surplus ones retired, while the rest keep running. Pipes stay
+ * on the shard they are bound to, only new pipes see the new shards.
+ */
+int wp_resize(void)
+{
+	int nr = wp_nr_threads();
+	int i;
+
+	if (nr == nr_shards)
+		return 0;
+
+	for (i = nr_shards; i < nr; i++) {
+		if (wp_shard_start(i)) {
+			pr_err("Can't start worker %d\n", i);
+			nr = i;
+			break;
+		}
+	}
+
+	if (!nr) {
+		pr_err("Can't resize worker pool, keeping %d threads\n",
+			nr_shards);
+		return -ENOMEM;
+	}
+
+	/* Publish new shards only once they run, retire after the fact */
+	i = nr_shards;
+	g_atomic_int_set(&nr_shards, nr);
+	if (wp_next_shard >= nr)
+		wp_next_shard = 0;
+	for (; i > nr; i--)
+		wp_shard_retire(shards[i - 1]);
+
+	pr_info("Worker pool resized to %d threads\n", nr);
 	return 0;
-out_error:
-	wp_destroy();
-	return -ENOMEM;
+}
+
+void wp_destroy(void)
+{
+	int i, c;
+
+	g_atomic_int_set(&nr_shards, 0);
+	for (i = 0; i < CIFSD_CONF_MAX_WORKER_THREADS && shards[i]; i++) {
+		if (!shards[i]->thread)
+			continue;
+		if (g_atomic_int_get(&shards[i]->state) == WP_SHARD_RUNNING)
+			g_atomic_int_set(&shards[i]->state, WP_SHARD_RETIRING);
+		g_async_queue_push(shards[i]->queue, &wp_shard_stop);
+	}
+
+	for (i = 0; i < CIFSD_CONF_MAX_WORKER_THREADS && shards[i]; i++) {
+		if (shards[i]->thread)
+			g_thread_join(shards[i]->thread);
+		g_async_queue_unref(shards[i]->queue);
+		for (c = 0; c < WP_NR_CLASSES; c++)
+			g_async_queue_unref(shards[i]->lanes[c]);
+		g_mutex_clear(&shards[i]->malloc_lock);
+		g_free(shards[i]);
+		shards[i] = NULL;
+	}
+
+	if (wp_pipes)
+		g_hash_table_destroy(wp_pipes);
+	wp_pipes = NULL;
+	if (wp_sessions)
+		g_hash_table_destroy(wp_sessions);
+	wp_sessions = NULL;
+	if (share_config_flights)
+		g_hash_table_destroy(share_config_flights);
+	share_config_flights = NULL;
+}
+
+int wp_init(void)
+{
+	share_config_flights = g_hash_table_new_full(g_str_hash,
+						     g_str_equal,
+						     g_free,
+						     free_share_config_flight);
+	if (!share_config_flights)
+		return -ENOMEM;
+
+	wp_pipes = g_hash_table_new(g_direct_hash, g_direct_equal);
+	if (!wp_pipes)
+		return -ENOMEM;
+
+	wp_sessions = g_hash_table_new_full(g_int64_hash,
+					    g_int64_equal,
+					    NULL,
+					    g_free);
+	if (!wp_sessions)
+		return -ENOMEM;
+
+	return wp_resize();
 }
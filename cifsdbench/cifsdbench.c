@@ -0,0 +1,692 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2018 Samsung Electronics Co., Ltd.
+ *
+ *   linux-cifsd-devel@lists.sourceforge.net
+ */
+
+#include <glib.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+
+#include <cifsdtools.h>
+#include <ipc_trace.h>
+
+#include <linux/cifsd_server.h>
+
+/*
+ * A fake kcifsd. Listens on a UNIX socket for `cifsd --ipc-socket',
+ * speaks the same generic netlink frames the kernel does, and either
+ * drives the cifsd request handlers as fast as cifsd answers, keeping
+ * a fixed number of requests in flight, or replays a trace recorded by
+ * `cifsd --record'. Reports end-to-end latency as seen by the "kernel",
+ * per request type.
+ */
+
+#define BENCH_MAX_MSG_SZ	(64 * 1024)
+
+enum {
+	BENCH_LOGIN = 1,
+	BENCH_SHARE_CONFIG,
+	BENCH_TREE_CONNECT,
+	BENCH_RPC,
+	/* Logins, tree connects and RPC opens in turn */
+	BENCH_MIX,
+};
+
+static char *arg_socket;
+static char *arg_account = "guest";
+static char *arg_share = "IPC$";
+static int arg_type = BENCH_LOGIN;
+static int arg_count = 100000;
+static int arg_inflight = 64;
+static char *arg_replay;
+static double arg_speed = 1.0;
+
+/* Give up on missing responses after that many msecs of silence */
+#define BENCH_REPLAY_IDLE_TIMEOUT	5000
+
+struct bench_req {
+	gint64		sent;
+	int		type;
+	int		rpc_close;
+};
+
+static struct bench_req *reqs;
+/* Latencies, usec, indexed by request type */
+static GArray *latencies[CIFSD_EVENT_MAX];
+
+struct bench_hdr {
+	struct nlmsghdr		nlh;
+	struct genlmsghdr	gnlh;
+	struct nlattr		nla;
+};
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: cifsdbench\n");
+
+	fprintf(stderr, "\t-s | --socket=PATH             UNIX socket to listen on\n");
+	fprintf(stderr, "\t-t | --type=login|share|tree|rpc|mix\n");
+	fprintf(stderr, "\t-n | --count=NUM               Number of requests\n");
+	fprintf(stderr, "\t-j | --inflight=NUM            Requests in flight\n");
+	fprintf(stderr, "\t-a | --account=NAME            Login/tree connect account\n");
+	fprintf(stderr, "\t-S | --share=NAME              Share to connect to\n");
+	fprintf(stderr, "\t-r | --replay=TRACE            Replay a `cifsd --record' trace\n");
+	fprintf(stderr, "\t-x | --speed=FACTOR            Replay speed-up, 0 - no delays\n");
+	fprintf(stderr, "\t-V | --version\n");
+
+	exit(EXIT_FAILURE);
+}
+
+static void show_version(void)
+{
+	printf("cifsd-tools version : %s\n", CIFSD_TOOLS_VERSION);
+	exit(EXIT_FAILURE);
+}
+
+static int bench_send(int fd, int type, void *payload, size_t sz)
+{
+	static const char pad[NLA_ALIGNTO];
+	size_t pad_sz = NLA_ALIGN(sz) - sz;
+	struct bench_hdr hdr;
+	struct iovec iov[3] = {
+		{ .iov_base = &hdr, .iov_len = sizeof(hdr) },
+		{ .iov_base = payload, .iov_len = sz },
+		{ .iov_base = (void *)pad, .iov_len = pad_sz },
+	};
+	struct msghdr mh = {
+		.msg_iov = iov,
+		.msg_iovlen = 3,
+	};
+
+	memset(&hdr, 0x00, sizeof(hdr));
+	hdr.nlh.nlmsg_len = sizeof(hdr) + sz + pad_sz;
+	hdr.nlh.nlmsg_type = GENL_MIN_ID;
+	hdr.gnlh.cmd = type;
+	hdr.gnlh.version = CIFSD_GENL_VERSION;
+	hdr.nla.nla_type = type;
+	hdr.nla.nla_len = NLA_HDRLEN + sz;
+
+	if (sendmsg(fd, &mh, 0) < 0) {
+		pr_err("sendmsg() has failed: %s\n", strerr(errno));
+		return -errno;
+	}
+	return 0;
+}
+
+/*
+ * Returns the event type and points @payload at the attribute data,
+ * or -EINVAL for anything we don't understand.
+ */
+static int bench_recv(int fd, char *buf, void **payload, int flags)
+{
+	struct bench_hdr *hdr = (struct bench_hdr *)buf;
+	ssize_t len;
+
+	len = recv(fd, buf, BENCH_MAX_MSG_SZ, flags);
+	if (len < 0 && errno == EAGAIN)
+		return -EAGAIN;
+	if (len <= 0) {
+		pr_err("cifsd has closed the connection\n");
+		return -ECONNRESET;
+	}
+
+	if (len < sizeof(*hdr) || hdr->nlh.nlmsg_type != GENL_MIN_ID ||
+	    hdr->nla.nla_len < NLA_HDRLEN ||
+	    sizeof(*hdr) - NLA_HDRLEN + hdr->nla.nla_len > len) {
+		pr_err("Malformed frame, %zd bytes\n", len);
+		return -EINVAL;
+	}
+
+	*payload = buf + sizeof(*hdr);
+	return hdr->gnlh.cmd;
+}
+
+static int bench_send_request(int fd, unsigned int handle)
+{
+	struct bench_req *req = &reqs[handle - 1];
+
+	req->sent = g_get_monotonic_time();
+
+	switch (req->type) {
+	case BENCH_LOGIN: {
+		struct cifsd_login_request ev;
+
+		memset(&ev, 0x00, sizeof(ev));
+		ev.handle = handle;
+		strncpy(ev.account, arg_account, sizeof(ev.account) - 1);
+		return bench_send(fd, CIFSD_EVENT_LOGIN_REQUEST,
+				  &ev, sizeof(ev));
+	}
+	case BENCH_SHARE_CONFIG: {
+		struct cifsd_share_config_request ev;
+
+		memset(&ev, 0x00, sizeof(ev));
+		ev.handle = handle;
+		strncpy(ev.share_name, arg_share, sizeof(ev.share_name) - 1);
+		return bench_send(fd, CIFSD_EVENT_SHARE_CONFIG_REQUEST,
+				  &ev, sizeof(ev));
+	}
+	case BENCH_TREE_CONNECT: {
+		struct cifsd_tree_connect_request ev;
+
+		memset(&ev, 0x00, sizeof(ev));
+		ev.handle = handle;
+		ev.session_id = handle;
+		ev.connect_id = handle;
+		ev.flags = CIFSD_TREE_CONN_FLAG_REQUEST_SMB2;
+		strncpy(ev.account, arg_account, sizeof(ev.account) - 1);
+		strncpy(ev.share, arg_share, sizeof(ev.share) - 1);
+		strcpy(ev.peer_addr, "127.0.0.1");
+		return bench_send(fd, CIFSD_EVENT_TREE_CONNECT_REQUEST,
+				  &ev, sizeof(ev));
+	}
+	case BENCH_RPC: {
+		struct cifsd_rpc_command ev;
+
+		memset(&ev, 0x00, sizeof(ev));
+		ev.handle = handle;
+		ev.flags = req->rpc_close ? CIFSD_RPC_CLOSE_METHOD :
+					    CIFSD_RPC_OPEN_METHOD;
+		return bench_send(fd, CIFSD_EVENT_RPC_REQUEST,
+				  &ev, sizeof(ev));
+	}
+	}
+	return -EINVAL;
+}
+
+/*
+ * Tree connects leave a tree connection behind, tear it down so that
+ * we don't run into the sessions limit.
+ */
+static void bench_tree_disconnect(int fd, unsigned int handle)
+{
+	struct cifsd_tree_disconnect_request ev;
+
+	memset(&ev, 0x00, sizeof(ev));
+	ev.session_id = handle;
+	ev.connect_id = handle;
+	bench_send(fd, CIFSD_EVENT_TREE_DISCONNECT_REQUEST, &ev, sizeof(ev));
+}
+
+static int bench_wait_for_cifsd(char *buf)
+{
+	struct sockaddr_un addr;
+	void *payload;
+	int lfd, fd, type;
+
+	if (strlen(arg_socket) >= sizeof(addr.sun_path)) {
+		pr_err("Socket path is too long\n");
+		return -EINVAL;
+	}
+
+	lfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (lfd < 0) {
+		pr_err("Can't create socket: %s\n", strerr(errno));
+		return -EINVAL;
+	}
+
+	memset(&addr, 0x00, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, arg_socket);
+	unlink(arg_socket);
+
+	if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(lfd, 1)) {
+		pr_err("Can't listen on %s: %s\n", arg_socket, strerr(errno));
+		close(lfd);
+		return -EINVAL;
+	}
+
+	pr_info("Waiting for `cifsd --ipc-socket=%s'\n", arg_socket);
+	fd = accept(lfd, NULL, NULL);
+	close(lfd);
+	unlink(arg_socket);
+	if (fd < 0) {
+		pr_err("accept() has failed: %s\n", strerr(errno));
+		return -EINVAL;
+	}
+
+	type = bench_recv(fd, buf, &payload, 0);
+	if (type != CIFSD_EVENT_STARTING_UP) {
+		pr_err("Expected startup event, got %d\n", type);
+		close(fd);
+		return -EINVAL;
+	}
+
+	pr_info("cifsd is up\n");
+	return fd;
+}
+
+static void bench_account(int type, gint64 latency)
+{
+	if (type <= 0 || type >= CIFSD_EVENT_MAX)
+		return;
+
+	if (!latencies[type])
+		latencies[type] = g_array_new(0, 0, sizeof(gint64));
+	g_array_append_val(latencies[type], latency);
+}
+
+static const char *event_name(int type)
+{
+	switch (type) {
+	case CIFSD_EVENT_HEARTBEAT_REQUEST:
+		return "heartbeat";
+	case CIFSD_EVENT_LOGIN_REQUEST:
+		return "login";
+	case CIFSD_EVENT_SHARE_CONFIG_REQUEST:
+		return "share config";
+	case CIFSD_EVENT_TREE_CONNECT_REQUEST:
+		return "tree connect";
+	case CIFSD_EVENT_TREE_DISCONNECT_REQUEST:
+		return "tree disconnect";
+	case CIFSD_EVENT_LOGOUT_REQUEST:
+		return "logout";
+	case CIFSD_EVENT_RPC_REQUEST:
+		return "rpc";
+	}
+	return "unknown";
+}
+
+static int cmp_latency(const void *a, const void *b)
+{
+	gint64 x = *(const gint64 *)a;
+	gint64 y = *(const gint64 *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void bench_report(gint64 elapsed)
+{
+	int type, total = 0;
+
+	for (type = 0; type < CIFSD_EVENT_MAX; type++) {
+		if (latencies[type])
+			total += latencies[type]->len;
+	}
+
+	if (!total) {
+		pr_info("No responses\n");
+		return;
+	}
+
+	pr_info("Responses: %d in %lld ms, %.0f req/s\n",
+		total,
+		(long long)elapsed / 1000,
+		total * 1000000.0 / MAX(elapsed, 1));
+
+	for (type = 0; type < CIFSD_EVENT_MAX; type++) {
+		GArray *arr = latencies[type];
+		gint64 *lat, sum = 0;
+		int i, nr;
+
+		if (!arr || !arr->len)
+			continue;
+
+		nr = arr->len;
+		lat = (gint64 *)arr->data;
+		qsort(lat, nr, sizeof(gint64), cmp_latency);
+		for (i = 0; i < nr; i++)
+			sum += lat[i];
+
+		pr_info("%-16s %8d, usec: avg %lld p50 %lld p90 %lld p99 %lld max %lld\n",
+			event_name(type),
+			nr,
+			(long long)sum / nr,
+			(long long)lat[nr / 2],
+			(long long)lat[nr * 90 / 100],
+			(long long)lat[nr * 99 / 100],
+			(long long)lat[nr - 1]);
+	}
+}
+
+static int bench_run(int fd, char *buf)
+{
+	static const int mix[] = {
+		BENCH_LOGIN,
+		BENCH_TREE_CONNECT,
+		BENCH_RPC,
+	};
+	int next = 1, done = 0, total = arg_count;
+	gint64 start, now;
+	int ret, type, i;
+
+	reqs = calloc(arg_count, sizeof(struct bench_req));
+	if (!reqs) {
+		pr_err("Out of memory\n");
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < arg_count; i++) {
+		reqs[i].type = arg_type;
+		if (arg_type == BENCH_MIX)
+			reqs[i].type = mix[i % ARRAY_SIZE(mix)];
+		/* RPC handles go through an open and a close */
+		if (reqs[i].type == BENCH_RPC)
+			total++;
+	}
+
+	start = g_get_monotonic_time();
+	while (next <= arg_count && next <= arg_inflight) {
+		ret = bench_send_request(fd, next++);
+		if (ret)
+			return ret;
+	}
+
+	while (done < total) {
+		unsigned int handle;
+		void *payload;
+
+		type = bench_recv(fd, buf, &payload, 0);
+		if (type == -ECONNRESET)
+			return type;
+		if (type < 0)
+			continue;
+
+		/* Every response we generate starts with the handle */
+		handle = *(__u32 *)payload;
+		if (handle < 1 || handle > arg_count) {
+			pr_err("Unexpected handle %u, event %d\n", handle, type);
+			continue;
+		}
+
+		now = g_get_monotonic_time();
+		/* Response type is request type + 1 */
+		bench_account(type - 1, now - reqs[handle - 1].sent);
+		done++;
+
+		if (type == CIFSD_EVENT_TREE_CONNECT_RESPONSE)
+			bench_tree_disconnect(fd, handle);
+
+		if (reqs[handle - 1].type == BENCH_RPC &&
+		    !reqs[handle - 1].rpc_close) {
+			reqs[handle - 1].rpc_close = 1;
+			ret = bench_send_request(fd, handle);
+			if (ret)
+				return ret;
+			continue;
+		}
+
+		if (next <= arg_count) {
+			ret = bench_send_request(fd, next++);
+			if (ret)
+				return ret;
+		}
+	}
+
+	bench_report(g_get_monotonic_time() - start);
+	return 0;
+}
+
+/*
+ * Trace replay. Events are sent with their original spacing divided
+ * by the speed-up factor. Responses are matched to requests by the
+ * request type and the handle, which is the first field of every
+ * request that gets a response; several requests in flight with the
+ * same handle (RPC on one pipe) are matched in FIFO order.
+ */
+static int has_response(int type)
+{
+	return type == CIFSD_EVENT_LOGIN_REQUEST ||
+	       type == CIFSD_EVENT_SHARE_CONFIG_REQUEST ||
+	       type == CIFSD_EVENT_TREE_CONNECT_REQUEST ||
+	       type == CIFSD_EVENT_RPC_REQUEST;
+}
+
+static GHashTable *pending;
+
+static gint64 *pending_key(int type, unsigned int handle)
+{
+	gint64 *key = g_new(gint64, 1);
+
+	*key = ((gint64)type << 32) | handle;
+	return key;
+}
+
+static void pending_push(int type, unsigned int handle, gint64 sent)
+{
+	gint64 *key = pending_key(type, handle);
+	gint64 *ts;
+	GQueue *q;
+
+	q = g_hash_table_lookup(pending, key);
+	if (!q) {
+		q = g_queue_new();
+		g_hash_table_insert(pending, key, q);
+	} else {
+		g_free(key);
+	}
+	ts = g_new(gint64, 1);
+	*ts = sent;
+	g_queue_push_tail(q, ts);
+}
+
+static int pending_pop(int type, unsigned int handle, gint64 *sent)
+{
+	gint64 *key = pending_key(type, handle);
+	gint64 *ts;
+	GQueue *q;
+
+	q = g_hash_table_lookup(pending, key);
+	g_free(key);
+	if (!q || g_queue_is_empty(q))
+		return -ENOENT;
+
+	ts = g_queue_pop_head(q);
+	*sent = *ts;
+	g_free(ts);
+	return 0;
+}
+
+static void bench_replay_recv(int fd, char *buf, int *outstanding)
+{
+	unsigned int handle;
+	void *payload;
+	gint64 sent;
+	int type;
+
+	while (1) {
+		type = bench_recv(fd, buf, &payload, MSG_DONTWAIT);
+		if (type == -EAGAIN || type == -ECONNRESET)
+			return;
+		if (type < 0)
+			continue;
+
+		handle = *(__u32 *)payload;
+		if (pending_pop(type - 1, handle, &sent)) {
+			pr_err("Unexpected handle %u, event %d\n", handle, type);
+			continue;
+		}
+
+		bench_account(type - 1, g_get_monotonic_time() - sent);
+		(*outstanding)--;
+	}
+}
+
+static int bench_replay(int fd, char *buf)
+{
+	struct cifsd_ipc_trace_hdr *hdr;
+	struct cifsd_ipc_trace_rec *rec;
+	gint64 start, first_ts = -1, now, due;
+	int outstanding = 0, nr_events = 0;
+	gsize off, len;
+	char *trace;
+	GError *err = NULL;
+
+	if (!g_file_get_contents(arg_replay, &trace, &len, &err)) {
+		pr_err("Can't read trace: %s\n", err->message);
+		g_error_free(err);
+		return -EINVAL;
+	}
+
+	hdr = (struct cifsd_ipc_trace_hdr *)trace;
+	if (len < sizeof(*hdr) || hdr->magic != CIFSD_IPC_TRACE_MAGIC ||
+	    hdr->version != CIFSD_IPC_TRACE_VERSION) {
+		pr_err("%s is not a cifsd IPC trace\n", arg_replay);
+		g_free(trace);
+		return -EINVAL;
+	}
+
+	pending = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+					g_free, (GDestroyNotify)g_queue_free);
+
+	start = g_get_monotonic_time();
+	off = sizeof(*hdr);
+	while (off + sizeof(*rec) <= len) {
+		rec = (struct cifsd_ipc_trace_rec *)(trace + off);
+		if (off + sizeof(*rec) + rec->sz > len) {
+			pr_err("Truncated trace record at offset %zu\n", off);
+			break;
+		}
+		off += sizeof(*rec) + rec->sz;
+
+		if (first_ts < 0)
+			first_ts = rec->ts;
+
+		/* Wait for the record's time, picking up responses */
+		while (arg_speed > 0) {
+			struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+			now = g_get_monotonic_time();
+			due = start + (rec->ts - first_ts) / arg_speed;
+			if (now >= due)
+				break;
+			if (poll(&pfd, 1, (due - now + 999) / 1000) > 0)
+				bench_replay_recv(fd, buf, &outstanding);
+		}
+
+		now = g_get_monotonic_time();
+		if (bench_send(fd, rec->type, rec->payload, rec->sz))
+			break;
+		nr_events++;
+
+		if (has_response(rec->type) && rec->sz >= sizeof(__u32)) {
+			pending_push(rec->type, *(__u32 *)rec->payload, now);
+			outstanding++;
+		}
+		bench_replay_recv(fd, buf, &outstanding);
+	}
+
+	while (outstanding > 0) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+		if (poll(&pfd, 1, BENCH_REPLAY_IDLE_TIMEOUT) <= 0) {
+			pr_err("%d responses are missing\n", outstanding);
+			break;
+		}
+		bench_replay_recv(fd, buf, &outstanding);
+	}
+
+	pr_info("Replayed %d events\n", nr_events);
+	bench_report(g_get_monotonic_time() - start);
+	g_hash_table_destroy(pending);
+	g_free(trace);
+	return 0;
+}
+
+static int parse_type(const char *type)
+{
+	if (!strcmp(type, "login"))
+		return BENCH_LOGIN;
+	if (!strcmp(type, "share"))
+		return BENCH_SHARE_CONFIG;
+	if (!strcmp(type, "tree"))
+		return BENCH_TREE_CONNECT;
+	if (!strcmp(type, "rpc"))
+		return BENCH_RPC;
+	if (!strcmp(type, "mix"))
+		return BENCH_MIX;
+	usage();
+	return -EINVAL;
+}
+
+static struct option opts[] = {
+	{"socket",	required_argument,	NULL,	's' },
+	{"type",	required_argument,	NULL,	't' },
+	{"count",	required_argument,	NULL,	'n' },
+	{"inflight",	required_argument,	NULL,	'j' },
+	{"account",	required_argument,	NULL,	'a' },
+	{"share",	required_argument,	NULL,	'S' },
+	{"replay",	required_argument,	NULL,	'r' },
+	{"speed",	required_argument,	NULL,	'x' },
+	{"version",	no_argument,		NULL,	'V' },
+	{"help",	no_argument,		NULL,	'h' },
+	{NULL,		0,			NULL,	 0  }
+};
+
+int main(int argc, char *argv[])
+{
+	char *buf;
+	int fd, ret, c;
+
+	set_logger_app_name("cifsdbench");
+	pr_logger_init(PR_LOGGER_STDIO);
+
+	opterr = 0;
+	while ((c = getopt_long(argc, argv, "s:t:n:j:a:S:r:x:Vh", opts, NULL)) != EOF)
+		switch (c) {
+		case 's':
+			arg_socket = g_strdup(optarg);
+			break;
+		case 't':
+			arg_type = parse_type(optarg);
+			break;
+		case 'n':
+			arg_count = atoi(optarg);
+			break;
+		case 'j':
+			arg_inflight = atoi(optarg);
+			break;
+		case 'a':
+			arg_account = g_strdup(optarg);
+			break;
+		case 'S':
+			arg_share = g_strdup(optarg);
+			break;
+		case 'r':
+			arg_replay = g_strdup(optarg);
+			break;
+		case 'x':
+			arg_speed = atof(optarg);
+			break;
+		case 'V':
+			show_version();
+			break;
+		case '?':
+		case 'h':
+		default:
+			usage();
+		}
+
+	if (!arg_socket || arg_count < 1 || arg_inflight < 1 || arg_speed < 0)
+		usage();
+
+	buf = malloc(BENCH_MAX_MSG_SZ);
+	if (!buf) {
+		pr_err("Out of memory\n");
+		return EXIT_FAILURE;
+	}
+
+	fd = bench_wait_for_cifsd(buf);
+	if (fd < 0)
+		return EXIT_FAILURE;
+
+	if (arg_replay)
+		ret = bench_replay(fd, buf);
+	else
+		ret = bench_run(fd, buf);
+	close(fd);
+	free(buf);
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
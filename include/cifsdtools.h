@@ -52,6 +52,16 @@ struct smbconf_global {
 	unsigned int		smb2_max_read;
 	unsigned int		smb2_max_write;
 	unsigned int		smb2_max_trans;
+	int			ipc_recv_batch;
+	int			worker_threads;
+	int			worker_queue_high;
+	int			worker_queue_low;
+	int			worker_stall_ms;
+	/*
+	 * Bumped on every config reload, and whenever a share changes
+	 * otherwise (force user/group resolved)
+	 */
+	unsigned int		conf_gen;
 };
 
 #define CIFSD_LOCK_FILE		"/tmp/cifsd.lock"
@@ -78,12 +88,24 @@ extern struct smbconf_global global_conf;
 
 #define CIFSD_CONF_FILE_MAX		10000
 
+#define CIFSD_CONF_DEFAULT_IPC_RECV_BATCH	32
+#define CIFSD_CONF_MAX_IPC_RECV_BATCH		128
+
+/* "worker threads = auto": online CPUs, within these bounds */
+#define CIFSD_CONF_WORKER_THREADS_AUTO		0
+#define CIFSD_CONF_MIN_WORKER_THREADS		4
+#define CIFSD_CONF_MAX_WORKER_THREADS		64
+
+#define CIFSD_CONF_DEFAULT_WORKER_QUEUE_HIGH	4096
+#define CIFSD_CONF_DEFAULT_WORKER_STALL_MS	1000
+
 #define PATH_PWDDB	"/etc/cifs/cifsdpwd.db"
 #define PATH_SMBCONF	"/etc/cifs/smb.conf"
 
 #define CIFSD_HEALTH_START		(0)
 #define CIFSD_HEALTH_RUNNING		(1 << 0)
 #define CIFSD_SHOULD_RELOAD_CONFIG	(1 << 1)
+#define CIFSD_SHOULD_DUMP_STATS		(1 << 2)
 
 extern int cifsd_health_status;
 
@@ -10,27 +10,57 @@
 
 /*
  * Older [prior to 4.9] kernels had max NL recv msg size of 16k.
- * It has been bumped to 32K later on.
+ * It has been bumped to 32K later on. The actual limit is picked at
+ * runtime, see ipc_msg_max_size().
  */
-#define CIFSD_IPC_MAX_MESSAGE_SIZE	(16 * 1024)
+#define CIFSD_IPC_MIN_MESSAGE_SIZE	(16 * 1024)
+#define CIFSD_IPC_MAX_MESSAGE_SIZE	(32 * 1024)
+
+struct ipc_rx_buf;
+struct ipc_resp_cache;
 
 struct cifsd_ipc_msg {
-	unsigned int	type;
-	unsigned int	sz;
-	unsigned char	____payload[0];
+	unsigned int		type;
+	unsigned int		sz;
+	/* IPC sender queue link */
+	struct cifsd_ipc_msg	*next;
+	/*
+	 * Inbound events are not copied out of the receive buffer:
+	 * ->payload points directly at the netlink attribute data and
+	 * ->rx_buf holds a reference on the buffer. Messages allocated
+	 * by ipc_msg_alloc() have NULL ->rx_buf and ->payload pointing
+	 * at ____payload.
+	 */
+	struct ipc_rx_buf	*rx_buf;
+	/* Response cache the message came from, 0 if none */
+	int			resp_cache;
+	struct ipc_resp_cache	*resp_owner;
+	/* Receive time, monotonic usec */
+	long long		received;
+	void			*payload;
+	unsigned char		____payload[0];
 };
 
 #define CIFSD_IPC_MSG_PAYLOAD(m)				\
-	(void *)(((struct cifsd_ipc_msg *)(m))->____payload)
+	(void *)(((struct cifsd_ipc_msg *)(m))->payload)
 
 #define CIFSD_STATUS_IPC_FATAL_ERROR	11
 
 struct cifsd_ipc_msg *ipc_msg_alloc(size_t sz);
+struct cifsd_ipc_msg *ipc_msg_alloc_response(unsigned int type, size_t sz);
 void ipc_msg_free(struct cifsd_ipc_msg *msg);
 
+/*
+ * Queues the message to the IPC sender thread. The message is owned
+ * by IPC from now on, the caller must not touch or free it.
+ */
 int ipc_msg_send(struct cifsd_ipc_msg *msg);
+size_t ipc_msg_max_size(void);
 
+int ipc_get_fd(void);
 int ipc_process_event(void);
+void ipc_housekeeping(void);
+void ipc_dump_stats(void);
 void ipc_destroy(void);
 int ipc_init(void);
 
@@ -0,0 +1,39 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2018 Samsung Electronics Co., Ltd.
+ *
+ *   linux-cifsd-devel@lists.sourceforge.net
+ */
+
+#ifndef __CIFSD_IPC_TRACE_H__
+#define __CIFSD_IPC_TRACE_H__
+
+#include <linux/types.h>
+
+/*
+ * IPC trace file: a header followed by one record per inbound event,
+ * in the order they were received. All fields are host endian, traces
+ * are meant to be replayed on the same kind of box.
+ */
+#define CIFSD_IPC_TRACE_MAGIC		0x54504943	/* "CIPT" */
+#define CIFSD_IPC_TRACE_VERSION		1
+
+struct cifsd_ipc_trace_hdr {
+	__u32	magic;
+	__u32	version;
+};
+
+struct cifsd_ipc_trace_rec {
+	/* Receive time, monotonic usec */
+	__u64	ts;
+	__u32	type;
+	__u32	sz;
+	__u8	payload[0];
+};
+
+int ipc_trace_open(const char *path);
+void ipc_trace_record(unsigned int type, void *payload, size_t sz);
+void ipc_trace_flush(void);
+void ipc_trace_close(void);
+
+#endif /* __CIFSD_IPC_TRACE_H__ */
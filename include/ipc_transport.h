@@ -0,0 +1,51 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2018 Samsung Electronics Co., Ltd.
+ *
+ *   linux-cifsd-devel@lists.sourceforge.net
+ */
+
+#ifndef __CIFSD_IPC_TRANSPORT_H__
+#define __CIFSD_IPC_TRANSPORT_H__
+
+#include <sys/socket.h>
+
+/*
+ * IPC transport backend. Every transport carries the same generic
+ * netlink frames (nlmsghdr, genlmsghdr, one attribute) over a datagram
+ * socket, so receive batching, frame parsing and the sender stage don't
+ * care which one is in use.
+ */
+struct ipc_transport {
+	const char		*name;
+
+	/*
+	 * ->init() connects to the peer and fills in the fields below,
+	 * ->destroy() closes the connection.
+	 */
+	int			(*init)(struct ipc_transport *t);
+	void			(*destroy)(struct ipc_transport *t);
+	/*
+	 * Optional, called once the startup event is sent: finds out
+	 * whether the peer takes larger messages than ->init() assumed,
+	 * and updates ->max_msg_sz.
+	 */
+	void			(*probe)(struct ipc_transport *t);
+
+	int			fd;
+	/* nlmsg_type of cifsd frames */
+	int			family_id;
+	/* nlmsg_pid of the frames we send */
+	unsigned int		port_id;
+	/* Destination address, NULL for connected sockets */
+	struct sockaddr		*peer;
+	socklen_t		peer_len;
+	/* Max message payload size the peer accepts */
+	size_t			max_msg_sz;
+};
+
+struct ipc_transport *ipc_unix_transport(const char *path);
+
+void ipc_set_transport(struct ipc_transport *t);
+
+#endif /* __CIFSD_IPC_TRANSPORT_H__ */
@@ -0,0 +1,25 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2018 Samsung Electronics Co., Ltd.
+ *
+ *   linux-cifsd-devel@lists.sourceforge.net
+ */
+
+#ifndef __CIFSD_MALLOC_STATS_H__
+#define __CIFSD_MALLOC_STATS_H__
+
+/*
+ * Number of heap allocations (malloc(), calloc(), realloc() and the
+ * aligned variants) made by the calling thread so far. Only counted
+ * when configured with --enable-malloc-stats, always 0 otherwise.
+ */
+#ifdef CONFIG_MALLOC_STATS
+unsigned long malloc_stats_calls(void);
+#else
+static inline unsigned long malloc_stats_calls(void)
+{
+	return 0;
+}
+#endif
+
+#endif /* __CIFSD_MALLOC_STATS_H__ */
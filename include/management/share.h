@@ -53,6 +53,15 @@ struct cifsd_share {
 	unsigned short	force_directory_mode;
 	unsigned short	force_uid;
 	unsigned short	force_gid;
+	/*
+	 * force user/group are resolved by the worker main thread, see
+	 * shm_resolve_pending_force_ids(). force_uid/force_gid are
+	 * published together under update_lock.
+	 */
+	char		*force_user;
+	char		*force_group;
+	int		force_ids_resolved;
+	int		force_ids_warned;
 
 	int		flags;
 
@@ -144,6 +153,8 @@ struct cifsd_share *shm_lookup_share(char *name);
 struct smbconf_group;
 int shm_add_new_share(struct smbconf_group *group);
 
+void shm_resolve_pending_force_ids(int wait);
+
 void shm_destroy(void);
 int shm_init(void);
 
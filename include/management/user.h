@@ -19,8 +19,13 @@ struct cifsd_user {
 	char		*pass;
 	int		pass_sz;
 
+	/*
+	 * Last ids NSS gave for the account, looked up at each login.
+	 * Only valid once a lookup has succeeded.
+	 */
 	uid_t		uid;
 	gid_t		gid;
+	int		ids_valid;
 
 	int		ref_count;
 	int 		flags;
@@ -0,0 +1,48 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2018 Samsung Electronics Co., Ltd.
+ *
+ *   linux-cifsd-devel@lists.sourceforge.net
+ */
+
+#ifndef __CIFSD_NSS_RESOLVER_H__
+#define __CIFSD_NSS_RESOLVER_H__
+
+#include <sys/types.h>
+
+/* uid/gid of users we could not resolve */
+#define NSS_FALLBACK_ID		9999
+
+/* Max time a caller waits for a lookup, msec */
+#define NSS_RESOLVE_TIMEOUT	1000
+
+/* How long lookup results are cached, seconds */
+#define NSS_CACHE_POSITIVE_TTL	600
+#define NSS_CACHE_NEGATIVE_TTL	60
+
+/*
+ * Return 0 on success, -ENOENT if there is no such user or group,
+ * -ETIMEDOUT if NSS did not answer in time and -EAGAIN if too many
+ * lookups are pending already. Callers block for up to
+ * NSS_RESOLVE_TIMEOUT.
+ */
+int nss_getpwnam(const char *name, uid_t *uid, gid_t *gid);
+int nss_getgrnam(const char *name, gid_t *gid);
+
+/*
+ * Never block: return the cached result, or start a lookup in the
+ * background and return -EAGAIN.
+ */
+int nss_peek_pwnam(const char *name, uid_t *uid, gid_t *gid);
+int nss_peek_grnam(const char *name, gid_t *gid);
+
+/* Start a lookup in the background, so that it is cached when needed */
+void nss_prefetch_pwnam(const char *name);
+void nss_prefetch_grnam(const char *name);
+
+void nss_housekeeping(void);
+void nss_dump_stats(void);
+void nss_resolver_destroy(void);
+int nss_resolver_init(void);
+
+#endif /* __CIFSD_NSS_RESOLVER_H__ */
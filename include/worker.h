@@ -8,9 +8,23 @@
 #ifndef __CIFSD_WORKER__H__
 #define __CIFSD_WORKER__H__
 
+#include <stddef.h>
+
 struct cifsd_ipc_msg;
 
+/*
+ * Request-scoped memory: valid until the worker is done with the
+ * current request, never free()-ed by the caller. Returns NULL when
+ * not called from a worker thread, callers fall back to the heap.
+ */
+void *wp_arena_alloc(size_t sz);
+
 int wp_ipc_msg_push(struct cifsd_ipc_msg *msg);
+void wp_run_inline(void);
+void wp_dump_stats(void);
+int wp_watchdog_interval(void);
+void wp_watchdog(void);
+int wp_resize(void);
 void wp_destroy(void);
 int wp_init(void);
 
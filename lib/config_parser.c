@@ -387,8 +387,71 @@ static int cp_add_global_guest_account(gpointer _v)
 	return 0;
 }
 
+static void cp_add_global_worker_threads(char *v)
+{
+	if (!g_ascii_strcasecmp(v, "auto")) {
+		global_conf.worker_threads = CIFSD_CONF_WORKER_THREADS_AUTO;
+		return;
+	}
+
+	global_conf.worker_threads = cp_get_group_kv_long(v);
+	if (global_conf.worker_threads < 1 ||
+		global_conf.worker_threads > CIFSD_CONF_MAX_WORKER_THREADS) {
+		pr_err("Invalid worker threads value, using auto\n");
+		global_conf.worker_threads = CIFSD_CONF_WORKER_THREADS_AUTO;
+	}
+}
+
+/*
+ * Global options that can be changed on config reload, the rest of
+ * [global] is only parsed at startup.
+ */
+static void global_group_reload_kv(gpointer _k,
+				   gpointer _v,
+				   gpointer user_data)
+{
+	if (!cp_key_cmp(_k, "worker threads")) {
+		cp_add_global_worker_threads(_v);
+		return;
+	}
+
+	if (!cp_key_cmp(_k, "worker stall threshold")) {
+		global_conf.worker_stall_ms = cp_get_group_kv_long(_v);
+		if (global_conf.worker_stall_ms < 0) {
+			pr_err("Invalid worker stall threshold value\n");
+			global_conf.worker_stall_ms =
+				CIFSD_CONF_DEFAULT_WORKER_STALL_MS;
+		}
+		return;
+	}
+
+	if (!cp_key_cmp(_k, "worker queue high watermark")) {
+		global_conf.worker_queue_high = cp_get_group_kv_long(_v);
+		return;
+	}
+
+	if (!cp_key_cmp(_k, "worker queue low watermark")) {
+		global_conf.worker_queue_low = cp_get_group_kv_long(_v);
+		return;
+	}
+}
+
+static void fixup_worker_queue(void)
+{
+	if (global_conf.worker_queue_high <= 0)
+		global_conf.worker_queue_high =
+			CIFSD_CONF_DEFAULT_WORKER_QUEUE_HIGH;
+	if (global_conf.worker_queue_low <= 0 ||
+			global_conf.worker_queue_low >=
+				global_conf.worker_queue_high)
+		global_conf.worker_queue_low =
+			global_conf.worker_queue_high * 3 / 4;
+}
+
 static void global_group_kv(gpointer _k, gpointer _v, gpointer user_data)
 {
+	global_group_reload_kv(_k, _v, user_data);
+
 	if (!cp_key_cmp(_k, "server string")) {
 		global_conf.server_string = cp_get_group_kv_string(_v);
 		return;
@@ -440,6 +503,17 @@ static void global_group_kv(gpointer _k, gpointer _v, gpointer user_data)
 		return;
 	}
 
+	if (!cp_key_cmp(_k, "ipc receive batch")) {
+		global_conf.ipc_recv_batch = cp_get_group_kv_long(_v);
+		if (global_conf.ipc_recv_batch < 1 ||
+			global_conf.ipc_recv_batch >
+				CIFSD_CONF_MAX_IPC_RECV_BATCH) {
+			pr_err("Invalid ipc receive batch value\n");
+			global_conf.ipc_recv_batch = 0;
+		}
+		return;
+	}
+
 	if (!cp_key_cmp(_k, "max open files")) {
 		global_conf.file_max = cp_get_group_kv_long(_v);
 		return;
@@ -548,6 +622,9 @@ static void fixup_missing_global_group(void)
 			cp_get_group_kv_string(CIFSD_CONF_DEFAULT_WORK_GROUP);
 	if (!global_conf.tcp_port)
 		global_conf.tcp_port = CIFSD_CONF_DEFAULT_TPC_PORT;
+	if (!global_conf.ipc_recv_batch)
+		global_conf.ipc_recv_batch = CIFSD_CONF_DEFAULT_IPC_RECV_BATCH;
+	fixup_worker_queue();
 
 	if (global_conf.sessions_cap <= 0)
 		global_conf.sessions_cap = CIFSD_CONF_DEFAULT_SESS_CAP;
@@ -569,6 +646,16 @@ static void global_group(struct smbconf_group *group)
 	g_hash_table_foreach(group->kv, global_group_kv, NULL);
 }
 
+static void global_group_reload(struct smbconf_group *group)
+{
+	global_conf.worker_threads = CIFSD_CONF_WORKER_THREADS_AUTO;
+	global_conf.worker_stall_ms = CIFSD_CONF_DEFAULT_WORKER_STALL_MS;
+	global_conf.worker_queue_high = 0;
+	global_conf.worker_queue_low = 0;
+	g_hash_table_foreach(group->kv, global_group_reload_kv, NULL);
+	fixup_worker_queue();
+}
+
 #define GROUPS_CALLBACK_STARTUP_INIT	0x1
 #define GROUPS_CALLBACK_REINIT		0x2
 
@@ -581,6 +668,8 @@ static void groups_callback(gpointer _k, gpointer _v, gpointer flags)
 
 	if (flags == (gpointer)GROUPS_CALLBACK_STARTUP_INIT)
 		global_group((struct smbconf_group *)_v);
+	else
+		global_group_reload((struct smbconf_group *)_v);
 }
 
 static int cp_add_ipc_share(void)
@@ -627,13 +716,20 @@ static int __cp_parse_smbconfig(const char *smbconf, GHFunc cb, long flags)
 
 int cp_parse_reload_smbconf(const char *smbconf)
 {
-	return __cp_parse_smbconfig(smbconf,
-				    groups_callback,
-				    GROUPS_CALLBACK_REINIT);
+	int ret;
+
+	ret = __cp_parse_smbconfig(smbconf,
+				   groups_callback,
+				   GROUPS_CALLBACK_REINIT);
+	/* Only now are the shares of the new generation all in place */
+	g_atomic_int_inc(&global_conf.conf_gen);
+	return ret;
 }
 
 int cp_parse_smbconf(const char *smbconf)
 {
+	/* 0 turns the watchdog off, so the default can't be a fixup */
+	global_conf.worker_stall_ms = CIFSD_CONF_DEFAULT_WORKER_STALL_MS;
 	return __cp_parse_smbconfig(smbconf,
 				    groups_callback,
 				    GROUPS_CALLBACK_STARTUP_INIT);
@@ -16,6 +16,7 @@
 
 #include <management/share.h>
 #include <management/user.h>
+#include <nss_resolver.h>
 #include <cifsdtools.h>
 
 /*
@@ -113,6 +114,8 @@ static void kill_cifsd_share(struct cifsd_share *share)
 	free(share->comment);
 	free(share->veto_list);
 	free(share->guest_account);
+	g_free(share->force_user);
+	g_free(share->force_group);
 	g_rw_lock_clear(&share->update_lock);
 	free(share);
 }
@@ -281,34 +284,123 @@ static void make_veto_list(struct cifsd_share *share)
 	}
 }
 
+/*
+ * The parser only starts the NSS lookups, so that a slow directory
+ * does not hold up the config (re)load. The ids are filled in by
+ * shm_resolve_force_ids() once the lookups are done.
+ */
 static void force_group(struct cifsd_share *share, char *name)
 {
-	struct group *grp;
-
-	grp = getgrnam(name);
-	if (grp) {
-		share->force_gid = grp->gr_gid;
-	} else {
-		pr_err("Unable to lookup up /etc/group entry: %s\n", name);
-	}
+	g_free(share->force_group);
+	share->force_group = g_strdup(name);
+	nss_prefetch_grnam(name);
 }
 
 static void force_user(struct cifsd_share *share, char *name)
 {
-	struct passwd *passwd;
+	g_free(share->force_user);
+	share->force_user = g_strdup(name);
+	nss_prefetch_pwnam(name);
+}
+
+static int shm_force_grnam(char *name, gid_t *gid, int wait)
+{
+	if (wait)
+		return nss_getgrnam(name, gid);
+	return nss_peek_grnam(name, gid);
+}
+
+static int shm_force_pwnam(char *name, uid_t *uid, gid_t *gid, int wait)
+{
+	if (wait)
+		return nss_getpwnam(name, uid, gid);
+	return nss_peek_pwnam(name, uid, gid);
+}
+
+/*
+ * Returns -EAGAIN if NSS has not answered yet, the next call tries
+ * again. Unknown names are logged once and leave the defaults, like
+ * the NSS failures always did, but are looked up again (in the NSS
+ * cache) until they resolve.
+ */
+static int shm_resolve_force_ids(struct cifsd_share *share, int wait)
+{
+	uid_t uid = CIFSD_SHARE_DEFAULT_UID;
+	gid_t gid = CIFSD_SHARE_DEFAULT_GID;
+	gid_t user_gid;
+	int missing = 0;
+	int changed;
+	int ret;
+
+	if (share->force_ids_resolved)
+		return 0;
+
+	if (share->force_group) {
+		ret = shm_force_grnam(share->force_group, &gid, wait);
+		if (ret == -ETIMEDOUT || ret == -EAGAIN)
+			return -EAGAIN;
+		if (ret) {
+			if (!share->force_ids_warned)
+				pr_err("Unable to lookup up /etc/group entry: %s\n",
+				       share->force_group);
+			gid = CIFSD_SHARE_DEFAULT_GID;
+			missing = 1;
+		}
+	}
 
-	passwd = getpwnam(name);
-	if (passwd) {
-		share->force_uid = passwd->pw_uid;
-		/*
-		 * smb.conf 'force group' has higher priority than
-		 * 'force user'.
-		 */
-		if (share->force_gid == 0)
-			share->force_gid = passwd->pw_gid;
-	} else {
-		pr_err("Unable to lookup up /etc/passwd entry: %s\n", name);
+	if (share->force_user) {
+		ret = shm_force_pwnam(share->force_user, &uid, &user_gid, wait);
+		if (ret == -ETIMEDOUT || ret == -EAGAIN)
+			return -EAGAIN;
+		if (ret) {
+			if (!share->force_ids_warned)
+				pr_err("Unable to lookup up /etc/passwd entry: %s\n",
+				       share->force_user);
+			uid = CIFSD_SHARE_DEFAULT_UID;
+			missing = 1;
+		} else if (gid == 0) {
+			/*
+			 * smb.conf 'force group' has higher priority than
+			 * 'force user'.
+			 */
+			gid = user_gid;
+		}
 	}
+
+	/* Config requests read both ids under the same lock */
+	g_rw_lock_writer_lock(&share->update_lock);
+	changed = share->force_uid != (unsigned short)uid ||
+		  share->force_gid != (unsigned short)gid;
+	share->force_uid = uid;
+	share->force_gid = gid;
+	g_rw_lock_writer_unlock(&share->update_lock);
+	/* Share config responses kept by the workers are stale now */
+	if (changed)
+		g_atomic_int_inc(&global_conf.conf_gen);
+
+	if (missing)
+		share->force_ids_warned = 1;
+	else
+		share->force_ids_resolved = 1;
+	return 0;
+}
+
+static void resolve_force_ids_cb(gpointer k, gpointer s, gpointer wait)
+{
+	shm_resolve_force_ids(s, GPOINTER_TO_INT(wait));
+}
+
+/*
+ * Fill in the force user/group ids of the shares that don't have them
+ * yet. Called from the worker main thread only: with @wait on startup,
+ * where it may block on NSS, and without on reloads and housekeeping,
+ * where it only picks up finished lookups. Config requests never wait
+ * for NSS; until the ids are resolved a share is served with the
+ * defaults.
+ */
+void shm_resolve_pending_force_ids(int wait)
+{
+	for_each_cifsd_share(resolve_force_ids_cb, GINT_TO_POINTER(wait));
 }
 
 static void process_group_kv(gpointer _k, gpointer _v, gpointer user_data)
@@ -708,8 +800,10 @@ int shm_handle_share_config_request(struct cifsd_share *share,
 	resp->directory_mask = share->directory_mask;
 	resp->force_create_mode = share->force_create_mode;
 	resp->force_directory_mode = share->force_directory_mode;
+	g_rw_lock_reader_lock(&share->update_lock);
 	resp->force_uid = share->force_uid;
 	resp->force_gid = share->force_gid;
+	g_rw_lock_reader_unlock(&share->update_lock);
 	resp->veto_list_sz = share->veto_list_sz;
 
 	if (test_share_flag(share, CIFSD_SHARE_FLAG_PIPE))
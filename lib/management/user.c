@@ -11,6 +11,7 @@
 #include <linux/cifsd_server.h>
 
 #include <management/user.h>
+#include <nss_resolver.h>
 #include <cifsdtools.h>
 
 static GHashTable	*users_table;
@@ -73,7 +74,6 @@ void put_cifsd_user(struct cifsd_user *user)
 static struct cifsd_user *new_cifsd_user(char *name, char *pwd)
 {
 	struct cifsd_user *user;
-	struct passwd *passwd;
 	size_t pass_sz;
 
 	user = calloc(1, sizeof(struct cifsd_user));
@@ -84,13 +84,6 @@ static struct cifsd_user *new_cifsd_user(char *name, char *pwd)
 	user->name = name;
 	user->pass_b64 = pwd;
 	user->ref_count = 1;
-	user->gid = 9999;
-	user->uid = 9999;
-	passwd = getpwnam(name);
-	if (passwd) {
-		user->uid = passwd->pw_uid;
-		user->gid = passwd->pw_gid;
-	}
 
 	user->pass = base64_decode(user->pass_b64, &pass_sz);
 	user->pass_sz = (int)pass_sz;
@@ -279,13 +272,72 @@ static int usm_copy_user_account(struct cifsd_user *user,
 	return -ENOSPC;
 }
 
+/*
+ * The ids are not looked up when the user database is parsed, which
+ * asks NSS once per account, but at login, every time. Repeated logins
+ * are answered from the NSS cache, so NSS is asked at most once per
+ * account and cache TTL, and accounts that appear in, change in or
+ * vanish from the directory are picked up once their cache entry
+ * expires.
+ *
+ * Accounts without a system user get NSS_FALLBACK_ID, as they always
+ * did. If NSS fails otherwise (times out, most likely), the ids from
+ * the last successful lookup are used, and without one the login
+ * fails: we don't make ids up.
+ */
+static int usm_resolve_user_ids(struct cifsd_user *user,
+				uid_t *uid,
+				gid_t *gid)
+{
+	int ret;
+
+	ret = nss_getpwnam(user->name, uid, gid);
+	if (!ret) {
+		g_rw_lock_writer_lock(&user->update_lock);
+		user->uid = *uid;
+		user->gid = *gid;
+		user->ids_valid = 1;
+		g_rw_lock_writer_unlock(&user->update_lock);
+		return 0;
+	}
+
+	if (ret == -ENOENT) {
+		g_rw_lock_writer_lock(&user->update_lock);
+		user->ids_valid = 0;
+		g_rw_lock_writer_unlock(&user->update_lock);
+		*uid = NSS_FALLBACK_ID;
+		*gid = NSS_FALLBACK_ID;
+		return 0;
+	}
+
+	g_rw_lock_reader_lock(&user->update_lock);
+	if (user->ids_valid) {
+		*uid = user->uid;
+		*gid = user->gid;
+		ret = 0;
+	}
+	g_rw_lock_reader_unlock(&user->update_lock);
+
+	if (ret)
+		pr_err("Cannot resolve ids of %s: %s\n",
+		       user->name, strerr(-ret));
+	return ret;
+}
+
 static void __handle_login_request(struct cifsd_login_response *resp,
 				   struct cifsd_user *user)
 {
+	uid_t uid;
+	gid_t gid;
 	int hash_sz;
 
-	resp->gid = user->gid;
-	resp->uid = user->uid;
+	if (usm_resolve_user_ids(user, &uid, &gid)) {
+		resp->status = CIFSD_USER_FLAG_INVALID;
+		return;
+	}
+
+	resp->gid = gid;
+	resp->uid = uid;
 	resp->status = user->flags;
 	resp->status |= CIFSD_USER_FLAG_OK;
 
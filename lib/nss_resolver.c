@@ -0,0 +1,525 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2018 Samsung Electronics Co., Ltd.
+ *
+ *   linux-cifsd-devel@lists.sourceforge.net
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pwd.h>
+#include <grp.h>
+#include <glib.h>
+
+#include <cifsdtools.h>
+#include <nss_resolver.h>
+
+/*
+ * getpwnam() and getgrnam() can block for seconds when NSS is backed
+ * by LDAP or SSSD. Lookups are done by a few threads of our own and
+ * callers wait for at most NSS_RESOLVE_TIMEOUT: a lookup that takes
+ * longer is left to finish in the background and the caller carries
+ * on with -ETIMEDOUT.
+ *
+ * Callers that can't afford to wait at all, like the config parser,
+ * only start a lookup with nss_prefetch_*() and pick the result up
+ * from the cache later.
+ *
+ * Callers that ask for a name whose lookup is already running wait
+ * for that lookup rather than queueing another one, so a login storm
+ * for one account costs one NSS query. The number of running lookups
+ * is capped: beyond NSS_RESOLVER_MAX_PENDING callers get -EAGAIN right
+ * away instead of queueing behind a directory that doesn't answer.
+ *
+ * Tools that never call nss_resolver_init() resolve synchronously.
+ *
+ * Results, including "no such user", are cached for a while, so that
+ * config reloads don't query the directory for every account again.
+ * Timed out lookups are not, but their results are cached once the
+ * lookup finishes in the background. Expired entries are dropped by
+ * nss_housekeeping().
+ */
+#define NSS_RESOLVER_THREADS	4
+#define NSS_RESOLVER_MAX_PENDING	256
+
+enum {
+	NSS_PASSWD,
+	NSS_GROUP,
+};
+
+struct nss_cache_entry {
+	int		ret;
+	uid_t		uid;
+	gid_t		gid;
+	gint64		expires;
+};
+
+struct nss_req {
+	int		type;
+	char		*name;
+	/* The resolver thread and every caller waiting for the result */
+	int		ref_count;
+	GCond		cond;
+	int		done;
+	int		ret;
+	uid_t		uid;
+	gid_t		gid;
+};
+
+static GThreadPool *nss_pool;
+/* Protects the pending tables and the requests' results */
+static GMutex nss_lock;
+/* Queued and running lookups by name, see nss_req_queue() */
+static GHashTable *nss_pending[NSS_GROUP + 1];
+static int nss_pending_nr;
+/* Lookups still queued on destroy are dropped */
+static int nss_stopping;
+
+static GHashTable *nss_cache[NSS_GROUP + 1];
+static GMutex nss_cache_lock;
+
+static int nss_lookups;
+static int nss_timeouts;
+static int nss_merged;
+static int nss_rejected;
+static int nss_cache_expired;
+static int nss_cache_hits;
+static int nss_cache_negative_hits;
+
+static GHashTable *nss_cache_table(int type)
+{
+	if (!nss_cache[type])
+		nss_cache[type] = g_hash_table_new_full(g_str_hash,
+							g_str_equal,
+							g_free,
+							g_free);
+	return nss_cache[type];
+}
+
+static gboolean nss_cache_entry_expired(gpointer k, gpointer v, gpointer now)
+{
+	struct nss_cache_entry *e = v;
+
+	return e->expires <= *(gint64 *)now;
+}
+
+/* Drop expired entries, names that are never asked for again included */
+void nss_housekeeping(void)
+{
+	gint64 now = g_get_monotonic_time();
+	int type, nr = 0;
+
+	g_mutex_lock(&nss_cache_lock);
+	for (type = NSS_PASSWD; type <= NSS_GROUP; type++) {
+		if (!nss_cache[type])
+			continue;
+		nr += g_hash_table_foreach_remove(nss_cache[type],
+						  nss_cache_entry_expired,
+						  &now);
+	}
+	g_mutex_unlock(&nss_cache_lock);
+
+	g_atomic_int_add(&nss_cache_expired, nr);
+}
+
+static int nss_cache_lookup(int type, const char *name,
+			    uid_t *uid, gid_t *gid)
+{
+	struct nss_cache_entry *e;
+	int ret = -EAGAIN;
+
+	g_mutex_lock(&nss_cache_lock);
+	e = g_hash_table_lookup(nss_cache_table(type), name);
+	if (e && e->expires > g_get_monotonic_time()) {
+		ret = e->ret;
+		*uid = e->uid;
+		*gid = e->gid;
+	}
+	g_mutex_unlock(&nss_cache_lock);
+
+	if (!ret)
+		g_atomic_int_inc(&nss_cache_hits);
+	else if (ret != -EAGAIN)
+		g_atomic_int_inc(&nss_cache_negative_hits);
+	return ret;
+}
+
+static void nss_cache_update(struct nss_req *req, int ret)
+{
+	struct nss_cache_entry *e;
+	gint64 ttl;
+
+	if (ret == 0)
+		ttl = NSS_CACHE_POSITIVE_TTL;
+	else if (ret == -ENOENT)
+		ttl = NSS_CACHE_NEGATIVE_TTL;
+	else
+		return;
+
+	e = g_new(struct nss_cache_entry, 1);
+	e->ret = ret;
+	e->uid = req->uid;
+	e->gid = req->gid;
+	e->expires = g_get_monotonic_time() + ttl * G_USEC_PER_SEC;
+
+	g_mutex_lock(&nss_cache_lock);
+	g_hash_table_replace(nss_cache_table(req->type),
+			     g_strdup(req->name),
+			     e);
+	g_mutex_unlock(&nss_cache_lock);
+}
+
+static void nss_req_put(struct nss_req *req)
+{
+	if (!g_atomic_int_dec_and_test(&req->ref_count))
+		return;
+
+	g_cond_clear(&req->cond);
+	g_free(req->name);
+	g_free(req);
+}
+
+static int nss_resolve_passwd(struct nss_req *req, char *buf, size_t sz)
+{
+	struct passwd pwd, *res = NULL;
+	int err;
+
+	err = getpwnam_r(req->name, &pwd, buf, sz, &res);
+	if (err)
+		return -err;
+	if (!res)
+		return -ENOENT;
+
+	req->uid = pwd.pw_uid;
+	req->gid = pwd.pw_gid;
+	return 0;
+}
+
+static int nss_resolve_group(struct nss_req *req, char *buf, size_t sz)
+{
+	struct group grp, *res = NULL;
+	int err;
+
+	err = getgrnam_r(req->name, &grp, buf, sz, &res);
+	if (err)
+		return -err;
+	if (!res)
+		return -ENOENT;
+
+	req->gid = grp.gr_gid;
+	return 0;
+}
+
+static int nss_resolve(struct nss_req *req)
+{
+	size_t sz = 16384;
+	char *buf;
+	int ret;
+
+	while (1) {
+		buf = g_try_malloc(sz);
+		if (!buf)
+			return -ENOMEM;
+
+		if (req->type == NSS_PASSWD)
+			ret = nss_resolve_passwd(req, buf, sz);
+		else
+			ret = nss_resolve_group(req, buf, sz);
+		g_free(buf);
+
+		/* Huge groups don't fit, retry with a bigger buffer */
+		if (ret != -ERANGE || sz >= 1024 * 1024)
+			break;
+		sz *= 2;
+	}
+
+	nss_cache_update(req, ret);
+	return ret;
+}
+
+static void nss_resolver_fn(gpointer data, gpointer user_data)
+{
+	struct nss_req *req = data;
+	int ret = -ETIMEDOUT;
+
+	if (!g_atomic_int_get(&nss_stopping))
+		ret = nss_resolve(req);
+
+	g_mutex_lock(&nss_lock);
+	g_hash_table_remove(nss_pending[req->type], req->name);
+	nss_pending_nr--;
+	req->ret = ret;
+	req->done = 1;
+	g_cond_broadcast(&req->cond);
+	g_mutex_unlock(&nss_lock);
+
+	nss_req_put(req);
+}
+
+static struct nss_req *nss_req_alloc(int type, const char *name)
+{
+	struct nss_req *req = g_new0(struct nss_req, 1);
+
+	req->type = type;
+	req->name = g_strdup(name);
+	req->ref_count = 1;
+	g_cond_init(&req->cond);
+	return req;
+}
+
+/*
+ * Join the lookup of @name that is already running, or queue a new
+ * one. Returns the request with a reference for the caller, or NULL
+ * if too many lookups are pending. Called with nss_lock held.
+ */
+static struct nss_req *nss_req_queue(int type, const char *name)
+{
+	struct nss_req *req;
+
+	if (!nss_pending[type])
+		nss_pending[type] = g_hash_table_new(g_str_hash, g_str_equal);
+
+	req = g_hash_table_lookup(nss_pending[type], name);
+	if (req) {
+		g_atomic_int_inc(&nss_merged);
+		g_atomic_int_inc(&req->ref_count);
+		return req;
+	}
+
+	if (nss_pending_nr >= NSS_RESOLVER_MAX_PENDING) {
+		g_atomic_int_inc(&nss_rejected);
+		return NULL;
+	}
+
+	/* The first reference belongs to the resolver thread */
+	req = nss_req_alloc(type, name);
+	if (!g_thread_pool_push(nss_pool, req, NULL)) {
+		nss_req_put(req);
+		return NULL;
+	}
+
+	g_atomic_int_inc(&nss_lookups);
+	g_hash_table_insert(nss_pending[type], req->name, req);
+	nss_pending_nr++;
+	g_atomic_int_inc(&req->ref_count);
+	return req;
+}
+
+static int nss_resolve_sync(int type, const char *name,
+			    uid_t *uid, gid_t *gid)
+{
+	struct nss_req *req = nss_req_alloc(type, name);
+	int ret;
+
+	g_atomic_int_inc(&nss_lookups);
+	ret = nss_resolve(req);
+	*uid = req->uid;
+	*gid = req->gid;
+	nss_req_put(req);
+	return ret;
+}
+
+static int nss_lookup(int type, const char *name, uid_t *uid, gid_t *gid)
+{
+	struct nss_req *req;
+	gint64 deadline;
+	int ret;
+
+	ret = nss_cache_lookup(type, name, uid, gid);
+	if (ret != -EAGAIN)
+		return ret;
+
+	if (!nss_pool)
+		return nss_resolve_sync(type, name, uid, gid);
+
+	deadline = g_get_monotonic_time() +
+		NSS_RESOLVE_TIMEOUT * G_TIME_SPAN_MILLISECOND;
+
+	g_mutex_lock(&nss_lock);
+	req = nss_req_queue(type, name);
+	if (!req) {
+		g_mutex_unlock(&nss_lock);
+		pr_err("Too many NSS lookups pending, %s not resolved\n",
+		       name);
+		return -EAGAIN;
+	}
+
+	while (!req->done) {
+		if (!g_cond_wait_until(&req->cond, &nss_lock, deadline))
+			break;
+	}
+	ret = req->done ? req->ret : -ETIMEDOUT;
+	if (!ret) {
+		*uid = req->uid;
+		*gid = req->gid;
+	}
+	g_mutex_unlock(&nss_lock);
+	nss_req_put(req);
+
+	if (ret == -ETIMEDOUT) {
+		g_atomic_int_inc(&nss_timeouts);
+		pr_err("NSS lookup of %s timed out\n", name);
+	}
+	return ret;
+}
+
+static void nss_prefetch(int type, const char *name)
+{
+	struct nss_req *req;
+	uid_t uid;
+	gid_t gid;
+
+	if (!nss_pool)
+		return;
+
+	if (nss_cache_lookup(type, name, &uid, &gid) != -EAGAIN)
+		return;
+
+	g_mutex_lock(&nss_lock);
+	req = nss_req_queue(type, name);
+	g_mutex_unlock(&nss_lock);
+	if (req)
+		nss_req_put(req);
+}
+
+/* The cached result, or -EAGAIN once a lookup is started */
+static int nss_peek(int type, const char *name, uid_t *uid, gid_t *gid)
+{
+	int ret;
+
+	ret = nss_cache_lookup(type, name, uid, gid);
+	if (ret == -EAGAIN && !nss_pool)
+		return nss_resolve_sync(type, name, uid, gid);
+	if (ret == -EAGAIN)
+		nss_prefetch(type, name);
+	return ret;
+}
+
+int nss_peek_pwnam(const char *name, uid_t *uid, gid_t *gid)
+{
+	uid_t u;
+	gid_t g;
+	int ret;
+
+	ret = nss_peek(NSS_PASSWD, name, &u, &g);
+	if (!ret) {
+		*uid = u;
+		*gid = g;
+	}
+	return ret;
+}
+
+int nss_peek_grnam(const char *name, gid_t *gid)
+{
+	uid_t u;
+	gid_t g;
+	int ret;
+
+	ret = nss_peek(NSS_GROUP, name, &u, &g);
+	if (!ret)
+		*gid = g;
+	return ret;
+}
+
+void nss_prefetch_pwnam(const char *name)
+{
+	nss_prefetch(NSS_PASSWD, name);
+}
+
+void nss_prefetch_grnam(const char *name)
+{
+	nss_prefetch(NSS_GROUP, name);
+}
+
+int nss_getpwnam(const char *name, uid_t *uid, gid_t *gid)
+{
+	uid_t u;
+	gid_t g;
+	int ret;
+
+	ret = nss_lookup(NSS_PASSWD, name, &u, &g);
+	if (!ret) {
+		*uid = u;
+		*gid = g;
+	}
+	return ret;
+}
+
+int nss_getgrnam(const char *name, gid_t *gid)
+{
+	uid_t u;
+	gid_t g;
+	int ret;
+
+	ret = nss_lookup(NSS_GROUP, name, &u, &g);
+	if (!ret)
+		*gid = g;
+	return ret;
+}
+
+void nss_dump_stats(void)
+{
+	pr_info("NSS lookups: %d, merged: %d, rejected: %d, timed out: %d\n",
+		g_atomic_int_get(&nss_lookups),
+		g_atomic_int_get(&nss_merged),
+		g_atomic_int_get(&nss_rejected),
+		g_atomic_int_get(&nss_timeouts));
+
+	pr_info("NSS cache hits: %d, negative hits: %d, expired: %d\n",
+		g_atomic_int_get(&nss_cache_hits),
+		g_atomic_int_get(&nss_cache_negative_hits),
+		g_atomic_int_get(&nss_cache_expired));
+}
+
+void nss_resolver_destroy(void)
+{
+	/*
+	 * Queued lookups are completed without asking NSS, so that their
+	 * requests are released, and the ones already in NSS are waited
+	 * for: they update the cache when they are done.
+	 */
+	g_atomic_int_set(&nss_stopping, 1);
+	if (nss_pool)
+		g_thread_pool_free(nss_pool, 0, 1);
+	nss_pool = NULL;
+
+	/* All lookups are done, so the pending tables are empty */
+	g_mutex_lock(&nss_lock);
+	if (nss_pending[NSS_PASSWD])
+		g_hash_table_destroy(nss_pending[NSS_PASSWD]);
+	if (nss_pending[NSS_GROUP])
+		g_hash_table_destroy(nss_pending[NSS_GROUP]);
+	nss_pending[NSS_PASSWD] = nss_pending[NSS_GROUP] = NULL;
+	g_mutex_unlock(&nss_lock);
+
+	/* No resolver thread is left to recreate the tables */
+	g_mutex_lock(&nss_cache_lock);
+	if (nss_cache[NSS_PASSWD])
+		g_hash_table_destroy(nss_cache[NSS_PASSWD]);
+	if (nss_cache[NSS_GROUP])
+		g_hash_table_destroy(nss_cache[NSS_GROUP]);
+	nss_cache[NSS_PASSWD] = nss_cache[NSS_GROUP] = NULL;
+	g_mutex_unlock(&nss_cache_lock);
+}
+
+int nss_resolver_init(void)
+{
+	GError *err = NULL;
+
+	nss_pool = g_thread_pool_new(nss_resolver_fn,
+				     NULL,
+				     NSS_RESOLVER_THREADS,
+				     0,
+				     &err);
+	if (!nss_pool) {
+		if (err) {
+			pr_err("Can't create NSS resolver: %s\n",
+				err->message);
+			g_error_free(err);
+		}
+		return -ENOMEM;
+	}
+	return 0;
+}
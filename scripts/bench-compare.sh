@@ -0,0 +1,147 @@
+#!/bin/sh
+#
+# Build two revisions and run the same cifsdbench load against both:
+#
+#	scripts/bench-compare.sh OLD NEW [cifsdbench options]
+#
+# e.g.	scripts/bench-compare.sh HEAD~1 HEAD -t rpc -n 100000 -j 64
+#
+# cifsdbench of the NEW revision drives both builds, so both see exactly
+# the same load. Both revisions need the UNIX socket transport (cifsd
+# --ipc-socket). Extra configure flags go in CONFIGURE_FLAGS. Build and
+# run logs are kept in the work directory printed at the end.
+#
+# WORKER_THREADS takes a list of `worker threads' values to sweep, e.g.
+#
+#	WORKER_THREADS="1 2 4 8 16 32 64" \
+#		scripts/bench-compare.sh 37c4ebb HEAD -t mix -n 100000 -j 64
+#
+# runs both revisions once per value; 37c4ebb is the last one that
+# dispatches through a GThreadPool.
+#
+# USERS=N adds N accounts to the user database, to compare startup
+# time ("Configuration parsed in") with a large database. The accounts
+# are not known to NSS, so point NSS at the directory to be measured.
+
+[ $# -ge 2 ] || {
+	echo "Usage: $0 OLD NEW [cifsdbench options]" >&2
+	exit 1
+}
+
+old=$1
+new=$2
+shift 2
+
+# Lines of the cifsdbench and cifsd logs worth comparing
+METRICS="req/s|usec: avg|parsed in|malloc calls"
+
+top=$(git rev-parse --show-toplevel) || exit 1
+work=$(mktemp -d /tmp/cifsd-bench.XXXXXX) || exit 1
+
+cleanup()
+{
+	for tree in "$work"/src-*; do
+		[ -d "$tree" ] && git -C "$top" worktree remove --force "$tree"
+	done
+}
+trap cleanup EXIT
+
+build()
+{
+	tree=$work/src-$1
+
+	echo "Building $2"
+	git -C "$top" worktree add --detach "$tree" "$2" >/dev/null 2>&1 &&
+	(cd "$tree" && ./autogen.sh && ./configure $CONFIGURE_FLAGS &&
+	 make -j"$(nproc)") >"$work/build-$1.log" 2>&1 || {
+		echo "Build of $2 has failed, see $work/build-$1.log" >&2
+		exit 1
+	}
+}
+
+run()
+{
+	name=$1
+	shift
+	sock=$work/sock-$name
+	rm -f "$sock"
+
+	"$work/src-new/cifsdbench/cifsdbench" -s "$sock" "$@" \
+		>"$work/bench-$name.log" 2>&1 &
+	bench=$!
+	while [ ! -S "$sock" ]; do
+		kill -0 $bench 2>/dev/null || {
+			cat "$work/bench-$name.log" >&2
+			return 1
+		}
+		sleep 0.1
+	done
+
+	"$work/src-$name/cifsd/cifsd" -n -c "$work/smb.conf" \
+		-u "$work/cifspwd.db" -i "$sock" \
+		>"$work/cifsd-$name.log" 2>&1 &
+	cifsd=$!
+
+	wait $bench
+	cpu_report $cifsd "$work/bench-$name.log"
+	# The worker dumps its statistics on the way out
+	kill -TERM $cifsd
+	wait $cifsd
+
+	grep -h -E "$METRICS" "$work/bench-$name.log" "$work/cifsd-$name.log"
+}
+
+# CPU time of the cifsd worker process and of its main thread, which
+# is the one that receives and decodes IPC frames, per response.
+cpu_report()
+{
+	worker=$(pgrep -P $1 | head -n 1)
+	responses=$(sed -n 's/.*Responses: \([0-9]*\) in.*/\1/p' "$2")
+
+	[ -n "$worker" ] && [ -n "$responses" ] || return 0
+	awk -v hz="$(getconf CLK_TCK)" -v nr="$responses" '
+		FNR == 1 {
+			sub(/^.*\) /, "")
+			cpu[FILENAME] = ($12 + $13) * 1000000 / hz
+		}
+		END {
+			printf "CPU per response, usec: worker %.2f, receive thread %.2f\n",
+				cpu[ARGV[1]] / nr, cpu[ARGV[2]] / nr
+		}' "/proc/$worker/stat" "/proc/$worker/task/$worker/stat"
+}
+
+build old "$old"
+build new "$new"
+
+write_conf()
+{
+	cat >"$work/smb.conf" <<EOF
+[global]
+	guest account = nobody
+${1:+	worker threads = $1}
+[bench]
+	path = $work
+	guest ok = yes
+EOF
+}
+
+touch "$work/cifspwd.db"
+"$work/src-new/cifsuseradd/cifsuseradd" -i "$work/cifspwd.db" \
+	-a bench -p bench >/dev/null
+if [ -n "$USERS" ]; then
+	hash=$(sed -n 's/^bench://p' "$work/cifspwd.db")
+	seq "$USERS" | awk -v hash="$hash" '{ print "bench-" $1 ":" hash }' \
+		>>"$work/cifspwd.db"
+fi
+
+# `-' keeps the built-in default
+for threads in ${WORKER_THREADS:--}; do
+	[ "$threads" = - ] && threads=
+	write_conf "$threads"
+	[ -n "$threads" ] && echo "=== worker threads = $threads"
+	echo "== $old"
+	run old "$@"
+	echo "== $new"
+	run new "$@"
+done
+echo "Logs: $work"